@@ -0,0 +1,32 @@
+/*
+ * myhog.c - Another handy routine for testing your tiny shell
+ *
+ * usage: myhog <n>
+ * Allocates and touches <n> megabytes, one megabyte at a time, then
+ * sleeps for a second. Exits with status 1 if an allocation fails.
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+
+int main(int argc, char **argv)
+{
+    int i, megs;
+    char *p;
+
+    if (argc != 2) {
+	fprintf(stderr, "Usage: %s <n>\n", argv[0]);
+	exit(0);
+    }
+    megs = atoi(argv[1]);
+    for (i=0; i < megs; i++) {
+	if ((p = malloc(1 << 20)) == NULL) {
+	    fprintf(stderr, "myhog: out of memory after %d megabytes\n", i);
+	    exit(1);
+	}
+	memset(p, i, 1 << 20);
+    }
+    sleep(1);
+    exit(0);
+}
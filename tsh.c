@@ -3,6 +3,7 @@
  * October 2021
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -13,12 +14,76 @@
 #include <sys/wait.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <pthread.h>
+#include <termios.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 /* Misc manifest constants */
 #define MAXLINE    1024   /* max line size */
 #define MAXARGS     128   /* max args on a command line */
 #define MAXJOBS      16   /* max jobs at any point in time */
 #define MAXJID    1<<16   /* max job ID */
+#define VARBUCKETS 1024   /* shell variable hash buckets (power of 2) */
+#define LINEBUCKETS 4096  /* parse cache hash buckets (power of 2) */
+#define MAXPLINES   4096  /* parse cache size before unused lines go */
+#define MAXDEPTH     64   /* max nesting of if/while/for/functions */
+#define MAXSET        8   /* max bytes in a scanset() set */
+#define MAXSPOOLS    64   /* max captured outputs kept for joblog */
+#define SPOOLCHUNK  (64*1024) /* read size when draining job output */
+#define TRIBUCKETS  65536 /* history trigram index buckets (power of 2) */
+#define HISTMAGIC   0x49485354u /* "TSHI", history index file magic */
+#define MAXSTAGES    16   /* max stages in a pipeline */
+#define POOLSIZE      4   /* threads for builtin pipeline stages */
+#define MAXMEMOS     16   /* max memo'd jobs with output still coming */
+#define MEMOSIZE   (64LL<<20) /* default bound on the result cache */
+#define MEMOREADMAX (1<<20) /* bigger files are keyed on their mtime */
+#define MEMOMAGIC "TSHMEMO1" /* result cache entry magic */
+
+/* Event loop sources, besides spools (which use their index) */
+#define EV_TIMER ((uint64_t)-1) /* tfd */
+#define EV_INPUT ((uint64_t)-2) /* standard input */
+#define EV_POOL  ((uint64_t)-3) /* pooldone: finished stage threads */
+#define EV_SIGNAL ((uint64_t)-4) /* sigfd: signals held off by poolwait */
+#define EV_MEMO  MAXSPOOLS /* up to 2*MAXMEMOS more: memos[i].fd[1..2] */
+
+/* Where builtins print: stdout, or a pipeline stage's buffer */
+#define OUT (tout != NULL ? tout : stdout)
+
+/* Output capture modes */
+#define CAP_OFF   0 /* background jobs write to the terminal */
+#define CAP_TAG   1 /* emit their output line by line, tagged [jid] */
+#define CAP_GROUP 2 /* emit it all, tagged, when the job finishes */
+
+/* Bytecode operations */
+#define OP_CMD     1 /* run line */
+#define OP_JMP     2 /* continue at arg */
+#define OP_JF      3 /* continue at arg if the last command failed */
+#define OP_FORINIT 4 /* push the expanded words of line */
+#define OP_FORNEXT 5 /* set name to the next word, at the end go to arg */
+#define OP_FORPOP  6 /* pop the innermost for loop */
+#define OP_DEFUN   7 /* define function name at pc+1, continue at arg */
+#define OP_RET     8 /* return from function, with status arg if >= 0 */
+
+/* Compiler block types */
+#define B_IF    1
+#define B_WHILE 2
+#define B_FOR   3
+#define B_FUNC  4
 
 /* Job states */
 #define UNDEF 0 /* undefined */
@@ -39,17 +104,220 @@
 /* Global variables */
 extern char **environ;      /* defined in libc */
 char prompt[] = "tsh> ";    /* command line prompt (DO NOT CHANGE) */
+char *shownprompt = prompt; /* the prompt editline redraws */
 int verbose = 0;            /* if true, print additional output */
 int nextjid = 1;            /* next job ID to allocate */
 char sbuf[MAXLINE];         /* for composing sprintf messages */
+int notifyfd = -1;          /* $TSH_EVENTFD: job events for tshtrace */
 
 struct job_t {              /* The job struct */
     pid_t pid;              /* job PID */
     int jid;                /* job ID [1, 2, ...] */
     int state;              /* UNDEF, BG, FG, or ST */
     char cmdline[MAXLINE];  /* command line */
+    int limited;            /* started by a limit prefix */
+    int cgfd;               /* its cgroup directory, -1 if rlimits */
+    char cgname[32];        /* its cgroup's name under cgbasefd */
+    long long mempeak;      /* peak memory in bytes, largest of its processes */
+    long long cpuusec;      /* CPU time in microseconds, summed over them */
+    long long ooms;         /* processes the memory limit killed, ditto */
+    pid_t procs[MAXSTAGES]; /* its processes, 0 once reaped */
+    int nprocs;             /* processes and stage threads still running */
+    pid_t tail;             /* process whose status is the job's, 0 if a thread */
 };
 struct job_t jobs[MAXJOBS]; /* The job list */
+
+struct job_t done[MAXJOBS]; /* jobs deleted since finishjobs last ran */
+int ndone;
+
+struct var_t {              /* A shell variable */
+    char *entry;            /* "name=value", handed to children as is */
+    int namelen;            /* length of the name part of entry */
+    int exported;           /* true if passed in the environment */
+    int envidx;             /* its slot in envcache, if exported */
+    struct var_t *next;     /* next variable in the hash bucket */
+};
+struct var_t *vars[VARBUCKETS]; /* The variable table */
+char **envcache;            /* envp built from the exported variables */
+int envcount;               /* number of entries in envcache */
+int envdirty = 1;           /* envcache must be rebuilt before use */
+char argquote[MAXARGS];     /* argquote[i] is true if argv[i] was quoted
+                               or expanded: text, never an operator */
+extern char *(*scanset)(const char *p, const char *set); /* see scan_resolve */
+int last_status;            /* exit status of the last command */
+char **posv;                /* positional parameters $0, $1, ... */
+int posc;                   /* number of positional parameters after $0 */
+int oneshot;                /* running a -c string or a script, not input */
+int sigsready;              /* the signal handlers are installed */
+int jobsready;              /* the job list is initialized */
+int varsready;              /* the environment has been imported */
+int tailexec;               /* the command being run is the shell's last */
+
+struct pline_t {            /* A tokenized command line */
+    unsigned long hash;     /* hash of text */
+    char *text;             /* the line as typed, ending in a newline */
+    int argc;               /* number of words */
+    int bg;                 /* background job? */
+    char **argv;            /* the words, as parseline split them */
+    char *quote;            /* argquote flags for argv */
+    int refs;               /* instructions in prog that use the line */
+    struct pline_t *next;   /* next line in the hash bucket */
+    struct pline_t *newer, *older; /* neighbours in the LRU list */
+};
+struct pline_t *lines[LINEBUCKETS]; /* The parse cache */
+struct pline_t *newest, *oldest; /* its LRU list */
+int nplines;                /* lines in the parse cache */
+
+struct insn_t {             /* A bytecode instruction */
+    int op;                 /* OP_CMD, OP_JMP, ... */
+    int arg;                /* jump target or status */
+    char *name;             /* loop variable or function name */
+    struct pline_t *line;   /* command, condition or word list */
+};
+struct insn_t *prog;        /* The compiled program */
+int ncode;                  /* number of instructions in prog */
+int maxcode;                /* allocated size of prog */
+
+struct block_t {            /* An open if/while/for/function block */
+    int type;               /* B_IF, B_WHILE, B_FOR or B_FUNC */
+    int start;              /* loop head or OP_DEFUN instruction */
+    int jf;                 /* pending exit jump, -1 if none */
+    int ends;               /* chain of jumps to fi or to the loop exit */
+};
+struct block_t blocks[MAXDEPTH]; /* The compiler's block stack */
+int depth;                  /* number of open blocks */
+int keepcode;               /* compiled code defines a function */
+
+struct func_t {             /* A shell function */
+    char *name;             /* function name */
+    int pc;                 /* first instruction of the body */
+    struct func_t *next;    /* next function */
+};
+struct func_t *funcs;       /* The function list */
+
+struct deadline_t {         /* A signal to send to a job at some time */
+    long long when;         /* due time, CLOCK_MONOTONIC nanoseconds */
+    pid_t pid;              /* job PID (and process group) */
+    int jid;                /* job ID, so a reused PID is not signaled */
+    int sig;                /* signal to send */
+    long long killafter;    /* if > 0, follow with SIGKILL this much later */
+};
+struct deadline_t *timers;  /* The deadline heap, soonest first */
+int ntimers;                /* number of deadlines in the heap */
+int maxtimers;              /* allocated size of the heap */
+int evfd = -1;              /* epoll instance of the event loop */
+int tfd = -1;               /* timerfd armed for timers[0] */
+
+struct spool_t {            /* Captured output of a background job */
+    int jid;                /* job ID, 0 if the slot is free */
+    pid_t pid;              /* job PID */
+    int fd;                 /* read end of the job's pipe, -1 at EOF */
+    int memfd;              /* everything the job wrote */
+    off_t size;             /* bytes in memfd */
+    off_t emitted;          /* bytes of memfd already shown */
+    int mode;               /* CAP_TAG or CAP_GROUP */
+    long seq;               /* creation order, to reuse the oldest slot */
+    char tag[16];           /* "[jid] " */
+};
+struct spool_t spools[MAXSPOOLS]; /* The capture spools */
+int capmode = CAP_OFF;      /* capture mode for new background jobs */
+long spoolseq;              /* sequence number of the last spool */
+
+struct limit_t {            /* The limits from a limit prefix */
+    int on;                 /* there was a limit prefix */
+    long long mem;          /* bytes, 0 for no limit */
+    long long cpu;          /* microseconds per 100ms period, 0: none */
+    long long pids;         /* processes, 0 for no limit */
+};
+int cgbasefd = -2;          /* $TSH_CGROUP, -1 if unusable, -2 unopened */
+int cgseq;                  /* number of job cgroups made */
+
+struct stage_t {            /* A builtin pipeline stage for the pool */
+    char **argv;            /* its words, packed */
+    int out;                /* where its output goes, closed when done */
+    pid_t job;              /* PID of the job it belongs to */
+    int last;               /* its status is the job's */
+    int status;             /* its exit status, once done */
+    struct stage_t *next;   /* next in the queue */
+};
+struct pipeline_t {         /* What startpipeline started */
+    pid_t procs[MAXSTAGES]; /* the forked stages */
+    int nprocs;             /* number of procs */
+    struct stage_t *threads[MAXSTAGES]; /* the builtin stages, not yet queued */
+    int nthreads;           /* number of threads */
+    pid_t tail;             /* the last stage, 0 if a builtin */
+};
+pthread_mutex_t statelock = PTHREAD_MUTEX_INITIALIZER; /* shell state; the
+                               main thread holds it except while it waits */
+pthread_mutex_t poollock = PTHREAD_MUTEX_INITIALIZER; /* guards poolq */
+pthread_cond_t poolcond = PTHREAD_COND_INITIALIZER; /* poolq has work */
+struct stage_t *poolq;      /* stages waiting for a thread, oldest first */
+int npool;                  /* stage threads started */
+int pooldone[2] = { -1, -1 }; /* finished stages come back through here */
+int sigfd = -1;             /* readable while poolwait holds off a signal */
+__thread FILE *tout;        /* output of the builtin this thread runs */
+__thread pid_t tjob;        /* job of the stage this thread runs, 0 if none */
+
+struct memo_t {             /* The recording of a memo'd job */
+    uint64_t key;           /* hash of what its result depends on */
+    pid_t pid;              /* the job, -1 while it is started, 0 once it
+                               has left the foreground */
+    int nopen;              /* pipes not yet at EOF, 0 if idle */
+    int fd[3];              /* read ends for its stdout and stderr */
+    int to[3];              /* where they are copied: ours, or files */
+    int saved[3];           /* our own, while the job is started */
+    char *rec;              /* chunks: stream byte, uint32 length, bytes */
+    size_t len;             /* bytes in rec */
+    size_t max;             /* allocated size of rec */
+    size_t last;            /* offset of the last chunk */
+    int keep;               /* the recording is still worth storing */
+    long long start;        /* nowns() when it started */
+};
+struct memohdr_t {          /* The start of a result cache entry */
+    char magic[8];          /* MEMOMAGIC */
+    long long usecs;        /* how long the job took */
+    long long status;       /* its exit status */
+};
+struct memoent_t {          /* A cache entry, as memoscan lists it */
+    char name[17];          /* the key, in hex */
+    long long size;         /* bytes */
+    long long used;         /* mtime, nanoseconds: when last stored or hit */
+};
+struct memo_t memos[MAXMEMOS]; /* The recordings, free if pid and nopen are 0 */
+int memodirfd = -2;         /* $TSH_MEMODIR, -1 if unusable, -2 unopened */
+long memohits, memomisses, memoskips; /* memo outcomes this session */
+long long memosaved;        /* run time the hits saved, microseconds */
+
+struct posting_t {          /* Records containing one trigram (bucket) */
+    uint32_t *ids;          /* record numbers, ascending */
+    uint32_t n;             /* number of ids */
+    uint32_t max;           /* allocated size of ids, 0 if in histidx */
+};
+int histfd = -1;            /* O_APPEND descriptor of the history file */
+pid_t histowner;            /* the shell, as opposed to its children */
+char *histmap;              /* the history file, mapped read-only */
+size_t histmapsize;         /* bytes mapped */
+uint64_t *histrecs;         /* offset of each record in the file */
+uint32_t nhist;             /* number of records indexed */
+uint32_t maxhist;           /* allocated size of histrecs, 0 if in histidx */
+uint32_t histsaved;         /* records covered by the index file */
+uint64_t histend;           /* file offset indexed up to */
+struct posting_t *tris;     /* The trigram index, NULL until loaded */
+char *histidx;              /* the index file it was loaded from, mapped */
+size_t histidxsize;         /* bytes mapped */
+
+/* Names that complete as commands besides PATH and functions */
+char *builtins[] = {
+    ":", "[", "bg", "capture", "deadline", "exec", "export", "false", "fg",
+    "history", "jobs", "joblog", "limit", "memo", "quit", "test", "timeout",
+    "true", "unset", NULL
+};
+pthread_mutex_t exelock = PTHREAD_MUTEX_INITIALIZER; /* guards exe* */
+char **exenames;            /* executables on PATH, sorted, no repeats */
+int nexe;                   /* number of exenames */
+int maxexe;                 /* allocated size of exenames */
+int exegen;                 /* bumped to retire the indexing thread */
+char *exepath;              /* the PATH being indexed, NULL if none */
 /* End global variables */
 
 
@@ -57,13 +325,19 @@ struct job_t jobs[MAXJOBS]; /* The job list */
 
 /* Here are the functions that you will implement */
 void eval(char *cmdline);
+void evalline(struct pline_t *pl);
 int builtin_cmd(char **argv);
+int redirop(const char *word);
+int redirect(char **argv, const char *quote);
+int tailok(char **argv);
+int execcmd(char **argv, const char *quote, char **envp);
 void do_bgfg(char **argv);
 void waitfg(pid_t pid);
 
 void sigchld_handler(int sig);
 void sigtstp_handler(int sig);
 void sigint_handler(int sig);
+void initsignals(void);
 
 /* Here are helper routines that we've provided for you */
 int parseline(const char *cmdline, char **argv);
@@ -74,12 +348,86 @@ void initjobs(struct job_t *jobs);
 int maxjid(struct job_t *jobs);
 int addjob(struct job_t *jobs, pid_t pid, int state, char *cmdline);
 int deletejob(struct job_t *jobs, pid_t pid);
+void finishjobs(void);
 pid_t fgpid(struct job_t *jobs);
 struct job_t *getjobpid(struct job_t *jobs, pid_t pid);
 struct job_t *getjobjid(struct job_t *jobs, int jid);
+struct job_t *getjobproc(struct job_t *jobs, pid_t pid);
 int pid2jid(pid_t pid);
 void listjobs(struct job_t *jobs);
 
+char *scan_scalar(const char *p, const char *set);
+
+void initvars(void);
+struct var_t *findvar(const char *name, int len);
+char *getvar(const char *name);
+void setvar(const char *name, int len, const char *value, int exported);
+void unsetvar(const char *name);
+char **buildenvp(char **overrides, int n);
+int isassign(const char *word);
+int expandargs(char **argv);
+void do_export(char **argv);
+
+struct pline_t *cacheline(const char *cmdline);
+int compileline(char *line);
+void dropcode(int pc);
+void run(int pc);
+void runscript(char *path);
+void runstring(char *text);
+struct func_t *findfunc(const char *name);
+void callfunc(struct func_t *fn, char **argv);
+int do_test(char **argv);
+
+int readcmdline(char *buf, int size);
+void waitevents(int wantinput, sigset_t *waitmask);
+long long nowns(void);
+int parseduration(const char *s, long long *ns);
+int parsesig(const char *s);
+int parsetimeout(char **argv, struct deadline_t *d);
+void adddeadline(pid_t pid, long long when, int sig, long long killafter);
+void dropdeadlines(pid_t pid, int jid);
+void firedeadlines(void);
+void do_deadline(char **argv);
+
+void initevents(void);
+void addspool(pid_t pid, int fd);
+void drainspool(struct spool_t *sp);
+void do_capture(char **argv);
+int do_joblog(char **argv);
+
+int parselimit(char **argv, struct limit_t *l);
+int limitcgroup(struct limit_t *l, char *name);
+void limitchild(struct limit_t *l, int cgfd);
+void limitjob(pid_t pid, int cgfd, char *name);
+void limitreap(struct job_t *job);
+
+void initchild(pid_t pgid);
+void execwords(char **argv, const char *quote, char **envp);
+int stagebuiltin(char **argv);
+pid_t startpipeline(char ***stages, char **quotes, int n, char **envp, int capfd,
+                    struct limit_t *lim, int cgfd, struct pipeline_t *pp);
+void addstages(pid_t pid, struct pipeline_t *pp);
+void stagedone(void);
+
+int memostart(char ***stages, char **quotes, int n, char **envp);
+void memoforked(pid_t pid);
+void memodrain(struct memo_t *m, int stream);
+void memodone(pid_t pid);
+void do_memo(char **argv);
+
+char *histfile(const char *suffix);
+void histadd(const char *line);
+int histrefresh(void);
+const char *histget(uint32_t i, int *len);
+void histsave(void);
+int do_history(char **argv);
+
+char *pathfind(char *name);
+int editline(char *buf, int size);
+void startexeindex(void);
+
+void notify(char kind, pid_t pid);
+
 void usage(void);
 void unix_error(char *msg);
 void app_error(char *msg);
@@ -94,14 +442,13 @@ int main(int argc, char **argv)
 {
     char c;
     char cmdline[MAXLINE];
+    char *command = NULL; /* -c string */
     int emit_prompt = 1; /* emit prompt (default) */
-
-    /* Redirect stderr to stdout (so that driver will get all output
-     * on the pipe connected to stdout) */
-    dup2(1, 2);
+    int segstart = 0;    /* first instruction of the current input */
+    int interactive;     /* keep a history of what is typed */
 
     /* Parse the command line */
-    while ((c = getopt(argc, argv, "hvp")) != EOF) {
+    while ((c = getopt(argc, argv, "hvpc:")) != EOF) {
         switch (c) {
         case 'h':             /* print help message */
             usage();
@@ -112,41 +459,79 @@ int main(int argc, char **argv)
         case 'p':             /* don't print a prompt */
             emit_prompt = 0;  /* handy for automatic testing */
         break;
+        case 'c':             /* run a command string and exit */
+            command = optarg;
+        break;
     default:
             usage();
     }
     }
 
-    /* Install the signal handlers */
+    /* A -c string starts as little as it can: stderr stays apart, and
+     * the signal handlers, the job list and the shell variables are
+     * set up when first needed (see initsignals, addjob and findvar) */
+    if (command != NULL) {
+        posv = optind < argc ? &argv[optind] : argv;
+        posc = optind < argc ? argc - optind - 1 : 0;
+        oneshot = 1;
+        runstring(command);
+        fflush(stdout);
+        exit(last_status);
+    }
 
-    /* These are the ones you will need to implement */
-    Signal(SIGINT,  sigint_handler);   /* ctrl-c */
-    Signal(SIGTSTP, sigtstp_handler);  /* ctrl-z */
-    Signal(SIGCHLD, sigchld_handler);  /* Terminated or stopped child */
+    /* Redirect stderr to stdout (so that driver will get all output
+     * on the pipe connected to stdout) */
+    dup2(1, 2);
 
-    /* This one provides a clean way to kill the shell */
-    Signal(SIGQUIT, sigquit_handler);
+    /* Install the signal handlers */
+    initsignals();
 
-    /* Initialize the job list */
-    initjobs(jobs);
+    /* Run a script: compile it all, then execute it */
+    if (optind < argc) {
+        posv = &argv[optind];
+        posc = argc - optind - 1;
+        oneshot = 1;
+        runscript(argv[optind]);
+        fflush(stdout);
+        exit(last_status);
+    }
+    posv = argv;
+    interactive = isatty(STDIN_FILENO) || getvar("TSH_HISTFILE") != NULL;
+    histowner = getpid();
+    atexit(histsave);
+    if (getvar("TSH_EVENTFD") != NULL) {
+        notifyfd = atoi(getvar("TSH_EVENTFD"));
+        fcntl(notifyfd, F_SETFD, FD_CLOEXEC);
+    }
 
     /* Execute the shell's read/eval loop */
     while (1) {
 
     /* Read command line */
     if (emit_prompt) {
-        printf("%s", prompt);
+        shownprompt = depth ? "> " : prompt;
+        printf("%s", shownprompt);
         fflush(stdout);
     }
-    if ((fgets(cmdline, MAXLINE, stdin) == NULL) && ferror(stdin))
-        app_error("fgets error");
-    if (feof(stdin)) { /* End of file (ctrl-d) */
+    notify('R', 0);
+    if ((emit_prompt && isatty(STDIN_FILENO) ? editline(cmdline, MAXLINE) :
+         readcmdline(cmdline, MAXLINE)) == 0) { /* End of file (ctrl-d) */
         fflush(stdout);
         exit(0);
     }
+    if (interactive)
+        histadd(cmdline);
 
-    /* Evaluate the command line */
-    eval(cmdline);
+    /* Compile the command line, and run it once its blocks are closed */
+    if (compileline(cmdline) < 0)
+        dropcode(segstart);
+    else if (depth == 0) {
+        run(segstart);
+        if (!keepcode)
+            dropcode(segstart);
+        segstart = ncode;
+        keepcode = 0;
+    }
     fflush(stdout);
     fflush(stdout);
     }
@@ -167,134 +552,214 @@ int main(int argc, char **argv)
 */
 void eval(char *cmdline)
 {
+    evalline(cacheline(cmdline));
+}
+
+/*
+ * evalline - eval for a line that has already been through cacheline
+ */
+void evalline(struct pline_t *pl)
+{
+    char *cmdline = pl->text;
+    struct func_t *fn;
     int bg;              //if the job should run, this would be TRUE
     pid_t pid;
     sigset_t mask, prev_mask;
-    int clean = 0;
-    int nstdin; // standard input
-    int nstdout;  // standard output
-    int nstderr;  // standard error
-    int fd[2];
     int i = 0;
-    int Child1;
-    int Child2;
     char *argv[MAXARGS]; //arguement list
-    char buf[MAXLINE];   // this holds the modified command line
-    char *arg_clean[MAXARGS]; // clean arg list for redirects
-    // parse the line
-    strcpy(buf, cmdline);
-    bg = parseline(cmdline, argv);
-    //check if valid builtin_cmd
-    strcpy(buf, cmdline);
-    bg = parseline(buf, argv);
+    char **stages[MAXSTAGES]; // pipeline stages, within argv
+    char *quotes[MAXSTAGES]; // and their argquote flags
+    int nstages;         // number of stages
+    struct pipeline_t pipeline; // what was started for them
+    char **envp;         // environment for the child
+    int nassign = 0;     // number of leading VAR=val words
+    struct deadline_t tmo = { 0 }; // from a timeout prefix
+    int capfd[2] = { -1, -1 }; // pipe for captured output
+    int doexec = 0;      // from an exec prefix
+    struct limit_t lim = { 0 }; // from a limit prefix
+    int domemo = 0;      // from a memo prefix
+    int cgfd = -1;       // cgroup for a limited job
+    char cgname[32];     // and its name
+    int k;
+    // the line was parsed once by cacheline; work on a copy of its words
+    bg = pl->bg;
+    memcpy(argv, pl->argv, (pl->argc + 1) * sizeof(char *));
+    memcpy(argquote, pl->quote, pl->argc);
+    if (argv[0] != NULL && expandargs(argv) < 0)
+       return;
     if (argv[0] == NULL || bg == -1){// Ignore empty lines
        printf("No line contents\n");
        return;
     }
+    // leading VAR=val words: shell assignments on their own, otherwise
+    // environment overrides for this command only
+    while (argv[nassign] != NULL && !argquote[nassign] && isassign(argv[nassign]))
+        nassign++;
+    if (argv[nassign] == NULL) {
+        for (i = 0; i < nassign; i++) {
+            int len = strchr(argv[i], '=') - argv[i];
+            setvar(argv[i], len, argv[i] + len + 1, 0);
+        }
+        last_status = 0;
+        return;
+    }
+    // the environment is only built for a command that needs one
+    envp = nassign > 0 ? buildenvp(argv, nassign) : NULL;
+    for (i = 0; (argv[i] = argv[i + nassign]) != NULL; i++)
+        argquote[i] = argquote[i + nassign];
+    i = 0;
+    // command prefixes
+    while (argv[0] != NULL && !argquote[0]) {
+        if (!strcmp(argv[0], "timeout"))
+            k = parsetimeout(argv, &tmo);
+        else if (!strcmp(argv[0], "exec"))
+            k = doexec = 1;
+        else if (!strcmp(argv[0], "limit"))
+            k = parselimit(argv, &lim);
+        else if (!strcmp(argv[0], "memo") && argv[1] != NULL && argv[1][0] != '-')
+            k = domemo = 1;
+        else
+            break;
+        if (k < 0) {
+            if (envp != envcache)
+                free(envp);
+            last_status = 125;
+            return;
+        }
+        for (i = 0; (argv[i] = argv[i + k]) != NULL; i++)
+            argquote[i] = argquote[i + k];
+        i = 0;
+    }
+    // split a pipeline into its stages
+    stages[0] = argv;
+    quotes[0] = argquote;
+    for (nstages = 1, i = 0; argv[i] != NULL; i++) {
+        if (!strcmp(argv[i], "|") && !argquote[i] && nstages < MAXSTAGES) {
+            argv[i] = NULL;
+            quotes[nstages] = &argquote[i + 1];
+            stages[nstages++] = &argv[i + 1];
+        }
+    }
+    for (i = 0; i < nstages; i++) {
+        if (stages[i][0] == NULL) {
+            printf("Invalid pipeline\n");
+            if (envp != envcache)
+                free(envp);
+            last_status = 2;
+            return;
+        }
+    }
+    // builtins don't read their input, so if there are only builtins,
+    // only the last one's output is ever seen
+    for (i = 0; i < nstages && stagebuiltin(stages[i]); i++)
+        ;
+    if (nstages > 1 && i == nstages) {
+        builtin_cmd(stages[nstages - 1]);
+        if (envp != envcache)
+            free(envp);
+        return;
+    }
+    i = 0;
+    // exec, or a last command that may as well be exec'd: no fork
+    if (nstages == 1 && !bg && tmo.when == 0 && !lim.on && !domemo && (doexec || tailok(argv))) {
+        if (envp == NULL)
+            envp = buildenvp(NULL, 0);
+        last_status = execcmd(argv, argquote, envp);
+        if (envp != envcache)
+            free(envp);
+        return;
+    }
+    if (nstages == 1 && (fn = findfunc(argv[0])) != NULL) {
+        if (envp != envcache)
+            free(envp);
+        callfunc(fn, argv);
+        return;
+    }
     // blocking first
     sigemptyset(&mask);
     sigaddset(&mask, SIGCHLD);
-    if (!builtin_cmd(argv)){
+    if (nstages == 1 && builtin_cmd(argv)) {
+        if (envp != envcache)
+            free(envp);
+    }
+    else {
+        initsignals();
+        if (envp == NULL)
+            envp = buildenvp(NULL, 0);
+        // a memo'd job that has run before is only replayed
+        if (domemo && bg)
+            memoskips++;
+        else if (domemo && memostart(stages, quotes, nstages, envp)) {
+            if (envp != envcache)
+                free(envp);
+            return;
+        }
+        if (bg && capmode != CAP_OFF && pipe2(capfd, O_CLOEXEC) < 0)
+            unix_error("pipe error");
+        if (lim.on)
+            cgfd = limitcgroup(&lim, cgname);
+        finishjobs();
+        // what builtins printed must come out before the child's output
+        fflush(stdout);
+        fflush(stderr);
         sigprocmask(SIG_BLOCK, &mask, &prev_mask);
-        pid = fork();
+        if (nstages > 1)
+            pid = startpipeline(stages, quotes, nstages, envp, capfd[1], &lim, cgfd, &pipeline);
+        else
+            pid = fork();
         if (pid < 0)// error in fork
         {
             unix_error("unable to run command");
         }
         else if (pid == 0){ // if process is child
-            sigprocmask(SIG_UNBLOCK, &mask, NULL);
-            setpgid(0, 0); // set child process group to its pid
-	    while(argv[i+1]!=NULL){
-                if(!strcmp(argv[i], "<")){ //series of ifs looking for which redirection operator is entered
-		    i++;
-		    fclose(fopen(argv[i],"w")); // empty file before appending
-                    nstdin = open(argv[i],O_RDONLY,S_IRWXU | S_IRWXG | S_IRWXO ); //open file in read only
-                    dup2(nstdin, STDIN_FILENO);//copying input to file
-                    close(nstdin); 
-                    continue;
-                }
-                else if(!strcmp(argv[i], ">")){
-		    i++;
-                    nstdout = open(argv[i], O_WRONLY | O_CREAT,S_IRWXU | S_IRWXG | S_IRWXO );//opening the file in write mode
-                    dup2(nstdout,STDOUT_FILENO);//copying entry nstdOUT to stdout_fileno
-                    close(nstdout);
-                    continue;
-                }
-                else if(!strcmp(argv[i], ">>")){
-                    i++;
-                    nstdout = open(argv[++i],O_WRONLY | O_CREAT | O_APPEND,S_IRWXU | S_IRWXG | S_IRWXO);//opening the file in appendmode
-                    dup2(nstdout,STDOUT_FILENO);
-                    close(nstdout);
-                    continue;
-                }
-                else if(!strcmp(argv[i], "2>")){
-                    i++;
-                    nstderr = open(argv[i],O_WRONLY | O_CREAT,S_IRWXU | S_IRWXG | S_IRWXO);//opening the file in appendmode
-                    dup2(nstderr,STDERR_FILENO); 
-                    close(nstderr);
-                    continue;
-                }
-		if (pipe(fd) < 0){
-			printf("Pipe init error\n");
-			exit(0);
-		}
-
-                if(!strcmp(argv[i],"|")){ //get what is on the right side of the pipe
-                    char * rP[MAXARGS];
-                    int l = 0;
-                    while(argv[i] !=NULL){
-                        rP[l++] = argv[++i];
-                    }
-                    if(Child1 = fork() == 0){//init pipe 
-			close(fd[0]); //close up input end of the pipe
-                        dup2(fd[1],STDOUT_FILENO);
-                        arg_clean[clean] = NULL;
-                        if (execve(arg_clean[0], arg_clean, environ) < 0)                            {
-                                printf("%s: Command not found.\n", argv[0]);
-                                exit(0);
-                        }
-   
-                    }
-                    if(Child1 < 0){ //if error in fork
-                         printf("Error forking.\n");
-                         exit(EXIT_FAILURE);                     
-		    }
-                    if(Child2 = fork () == 0) // second child init
-                    {
-                        close(fd[1]);//close output end of the pipe
-                        dup2(fd[0],STDIN_FILENO);
-                        if (execve(rP[0], rP, environ) < 0)                            {
-                                printf("%s: Command not found.\n", rP[0]);
-                                exit(0);
-                        }
-		    }
-                    if(Child2 < 0){ //if error in fork
-                         printf("Error forking.\n");
-                         exit(EXIT_FAILURE);     
-                    }
-                    exit(0);
-                }
-                arg_clean[clean++] = argv[i++];
-            }
-            arg_clean[clean] = NULL;
-            if (execve(arg_clean[0], arg_clean, environ) < 0)
-            {
-                printf("%s: Command not found.\n", arg_clean[0]);
-                exit(1);
+            initchild(0); // in a process group of its own
+            if (lim.on)
+                limitchild(&lim, cgfd);
+            if (capfd[1] >= 0) { // captured: both streams into the pipe
+                dup2(capfd[1], STDOUT_FILENO);
+                dup2(capfd[1], STDERR_FILENO);
             }
+            execwords(argv, argquote, envp);
         }
         // parent is going to add job first
 	    else {//bg = 1 backround job, bg = 0 foreground job
+	      // also set the group here, so that a signal forwarded before
+	      // the child gets to run still reaches it
+	      setpgid(pid, pid);
+	      if (domemo && !bg)
+	        memoforked(pid);
+	      if (envp != envcache)
+	        free(envp);
 	      if (!bg) { //parent adds job
 	        // bg = 0, foreground job
 	        addjob(jobs, pid, FG, cmdline);
+	        if (nstages > 1)
+	          addstages(pid, &pipeline);
+	        if (lim.on)
+	          limitjob(pid, cgfd, cgname);
+	        if (tmo.when > 0)
+	          adddeadline(pid, nowns() + tmo.when, tmo.sig, tmo.killafter);
 	        sigprocmask(SIG_SETMASK, &prev_mask, NULL); //allow parent to recieve sigchild
 	        waitfg(pid);
+	        if (domemo)
+	          memodone(pid);
 	        return;
 	      }
 	      addjob(jobs, pid, BG, cmdline);
+	      if (nstages > 1)
+	        addstages(pid, &pipeline);
+	      if (lim.on)
+	        limitjob(pid, cgfd, cgname);
+	      notify('B', pid);
+	      if (capfd[0] >= 0) {
+	        close(capfd[1]);
+	        addspool(pid, capfd[0]);
+	      }
+	      if (tmo.when > 0)
+	        adddeadline(pid, nowns() + tmo.when, tmo.sig, tmo.killafter);
 	      sigprocmask(SIG_SETMASK, &prev_mask, NULL);
 	      printf("[%d] (%d) %s", pid2jid(pid), pid, cmdline); //allow parent to recieve sigchild
+	      last_status = 0;
 	      return;
         }
     }
@@ -314,6 +779,7 @@ int parseline(const char *cmdline, char **argv)
     char *delim;                /* points to first space delimiter */
     int argc;                   /* number of args */
     int bg;                     /* background job? */
+    int quoted;                 /* current arg is single-quoted? */
 
     strcpy(buf, cmdline);
     buf[strlen(buf)-1] = ' ';  /* replace trailing '\n' with space */
@@ -322,28 +788,33 @@ int parseline(const char *cmdline, char **argv)
 
     /* Build the argv list */
     argc = 0;
-    if (*buf == '\'') {
+    if ((quoted = (*buf == '\'')) != 0) {
     buf++;
-    delim = strchr(buf, '\'');
+    delim = scanset(buf, "'");
     }
     else {
-    delim = strchr(buf, ' ');
+    delim = scanset(buf, " ");
     }
+    if (*delim == '\0')
+    delim = NULL;
 
     while (delim) {
+    argquote[argc] = quoted;
     argv[argc++] = buf;
     *delim = '\0';
     buf = delim + 1;
     while (*buf && (*buf == ' ')) /* ignore spaces */
            buf++;
 
-    if (*buf == '\'') {
+    if ((quoted = (*buf == '\'')) != 0) {
         buf++;
-        delim = strchr(buf, '\'');
+        delim = scanset(buf, "'");
     }
     else {
-        delim = strchr(buf, ' ');
+        delim = scanset(buf, " ");
     }
+    if (*delim == '\0')
+        delim = NULL;
     }
     argv[argc] = NULL;
 
@@ -363,7 +834,7 @@ int parseline(const char *cmdline, char **argv)
  */
 int builtin_cmd(char **argv) 
 {
-   
+    last_status = 0;
     if(strcmp(argv[0], "quit") == 0) {
       // if quit command, terminates the shell and exits
       exit(0);
@@ -379,12 +850,216 @@ int builtin_cmd(char **argv)
       do_bgfg(argv);
       return 1; 
     }
+    else if(strcmp(argv[0], "deadline") == 0) {
+      // signal a job when a time limit passes
+      do_deadline(argv);
+      return 1;
+    }
+    else if(strcmp(argv[0], "capture") == 0) {
+      // route background job output through tagged spools
+      do_capture(argv);
+      return 1;
+    }
+    else if(strcmp(argv[0], "joblog") == 0) {
+      // replay a background job's captured output
+      last_status = do_joblog(argv);
+      return 1;
+    }
+    else if(strcmp(argv[0], "history") == 0) {
+      // list or search the command history
+      last_status = do_history(argv);
+      return 1;
+    }
+    else if(strcmp(argv[0], "memo") == 0) {
+      // result cache statistics, or clear it
+      do_memo(argv);
+      return 1;
+    }
+    else if(strcmp(argv[0], "export") == 0) {
+      // mark variables for the environment, or list them
+      do_export(argv);
+      return 1;
+    }
+    else if(strcmp(argv[0], "true") == 0 || strcmp(argv[0], ":") == 0) {
+      return 1;
+    }
+    else if(strcmp(argv[0], "false") == 0) {
+      last_status = 1;
+      return 1;
+    }
+    else if(strcmp(argv[0], "test") == 0 || strcmp(argv[0], "[") == 0) {
+      // evaluate a condition for if and while
+      last_status = do_test(argv);
+      return 1;
+    }
+    else if(strcmp(argv[0], "unset") == 0) {
+      // remove variables from the shell and the environment
+      for (int i = 1; argv[i] != NULL; i++)
+        unsetvar(argv[i]);
+      return 1;
+    }
     else {
       // else not an built in function
       return 0;     
     }
 }
 
+/*
+ * redirop - If word starts with a redirection operator (<, >, >>, 2>,
+ * 2>> or the whole word 2>&1), return its length, else 0. The file
+ * is the rest of the word ("<file", ">>file") or, if that is empty,
+ * the next word.
+ */
+int redirop(const char *word)
+{
+    if (!strcmp(word, "2>&1"))
+        return 4;
+    if (word[0] == '<')
+        return 1;
+    if (word[0] == '2' && word[1] == '>')
+        return word[2] == '>' ? 3 : 2;
+    if (word[0] == '>')
+        return word[1] == '>' ? 2 : 1;
+    return 0;
+}
+
+/*
+ * redirect - If argv[0] is a redirection (and quote[0], its argquote
+ * flag, says it is not text), apply it to this process's descriptors
+ * and return the number of words it takes. Return 0 if it is not a
+ * redirection, -1 if the file can't be opened.
+ */
+int redirect(char **argv, const char *quote)
+{
+    int fd, n, target, flags;
+    char *file;
+
+    if (quote[0] || (n = redirop(argv[0])) == 0)
+        return 0;
+    if (n == 4)
+        return dup2(STDOUT_FILENO, STDERR_FILENO) < 0 ? -1 : 1;
+    if (argv[0][0] == '<') {
+        target = STDIN_FILENO;
+        flags = O_RDONLY;
+    }
+    else {
+        target = argv[0][0] == '2' ? STDERR_FILENO : STDOUT_FILENO;
+        flags = O_WRONLY | O_CREAT | (n > 1 && argv[0][n - 2] == '>' ? O_APPEND : O_TRUNC);
+    }
+    if ((file = argv[0][n] ? argv[0] + n : argv[1]) == NULL) {
+        printf("%s: missing file name\n", argv[0]);
+        return -1;
+    }
+    if ((fd = open(file, flags, 0666)) < 0) {
+        printf("%s: %s\n", file, strerror(errno));
+        return -1;
+    }
+    if (fd != target) {
+        dup2(fd, target);
+        close(fd);
+    }
+    return argv[0][n] ? 1 : 2;
+}
+
+/*
+ * tailok - Can the shell exec argv instead of forking it? Only for
+ * the last command of a -c string or script, when it is a single
+ * external command and the shell has no jobs, deadlines or captured
+ * output left to look after.
+ */
+int tailok(char **argv)
+{
+    int i;
+
+    if (!tailexec)
+        return 0;
+    finishjobs();
+    if (ntimers > 0 || maxjid(jobs) > 0 || findfunc(argv[0]) != NULL)
+        return 0;
+    for (i = 0; i < MAXSPOOLS; i++)
+        if (spools[i].jid != 0 && spools[i].fd >= 0)
+            return 0;
+    for (i = 0; builtins[i] != NULL; i++)
+        if (!strcmp(argv[0], builtins[i]))
+            return 0;
+    return access(pathfind(argv[0]), X_OK) == 0;
+}
+
+/*
+ * execcmd - Execute the builtin exec: apply the redirections in argv
+ * to the shell itself, then replace the shell with the command, if
+ * there is one. Return the status for $? if the shell is still here;
+ * a -c string or script whose command can't be run exits instead.
+ */
+int execcmd(char **argv, const char *quote, char **envp)
+{
+    char *words[MAXARGS];
+    int i, k, n = 0;
+
+    for (i = 0; argv[i] != NULL; i += k) {
+        if ((k = redirect(&argv[i], &quote[i])) < 0)
+            return 1;
+        if (k == 0)
+            words[n++] = argv[i++];
+    }
+    words[n] = NULL;
+    if (n == 0)
+        return 0;
+    fflush(stdout);
+    histsave();
+    execve(pathfind(words[0]), words, envp);
+    printf("%s: Command not found\n", words[0]);
+    if (oneshot)
+        exit(127);
+    return 127;
+}
+
+/*
+ * initchild - In a newly forked child: join process group pgid (0 for
+ * one of its own) and give signals back their default actions, so
+ * that until exec they act on the child as they will after it
+ */
+void initchild(pid_t pgid)
+{
+    sigset_t mask;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_UNBLOCK, &mask, NULL);
+    setpgid(0, pgid);
+    Signal(SIGINT, SIG_DFL);
+    Signal(SIGTSTP, SIG_DFL);
+    Signal(SIGQUIT, SIG_DFL);
+    Signal(SIGCHLD, SIG_DFL);
+}
+
+/*
+ * execwords - In a child: apply the redirections in argv (quote holds
+ * its argquote flags) and execute the rest of it. Nothing but
+ * redirections, as in ">file", just creates the files. Does not
+ * return.
+ */
+void execwords(char **argv, const char *quote, char **envp)
+{
+    char *words[MAXARGS];
+    int i, k, n = 0;
+
+    for (i = 0; argv[i] != NULL; i += k) {
+        if ((k = redirect(&argv[i], &quote[i])) < 0) // < > >> 2> 2>&1
+            exit(1);
+        if (k == 0)
+            words[n++] = argv[i++];
+    }
+    words[n] = NULL;
+    if (n == 0)
+        exit(0);
+    if (execve(pathfind(words[0]), words, envp) < 0)
+    {
+        printf("%s: Command not found\n", words[0]);
+        exit(1);
+    }
+}
+
 /*
  * do_bgfg - Execute the builtin bg and fg commands
  */
@@ -393,12 +1068,14 @@ void do_bgfg(char **argv)
       if (argv[1] == NULL){
 		// check if command has PID
 	      printf("%s command requires PID or %%jobid argument\n", argv[0]);
+	      last_status = 1;
 	      return;
       }
 
       if(!isdigit(argv[1][0]) && argv[1][0] != '%') {  
 		// check if argument has PID          
 	      printf("%s: argument must be a PID or %%jobid\n", argv[0]);
+	      last_status = 1;
 	      return;
       }
 	// Set a var for fg and bg
@@ -411,23 +1088,14 @@ void do_bgfg(char **argv)
       
       // Check for job id
       if (atoi(pidojid) == 0){
-		// Set a var for the length of thejobid
-	      int len_arg = strlen(pidojid);
-		// prep array to modify
-	      char mod_arg[len_arg-1];   
-	      
-	      // Remove %
-	      for (int i=0; i<len_arg-1; i++){
-		      mod_arg[i] = pidojid[i+1];
-	      }
-
-	      // atoi is str->int, set job id to int
-	      int possjobid = atoi(mod_arg);
+	      // atoi is str->int, set job id to int (skipping the %)
+	      int possjobid = atoi(pidojid + 1);
 
 	      // Check if job exists
 	      cur_job = getjobjid(jobs, possjobid);
 	      if (cur_job == NULL){
 		      printf("%s: No such job\n", pidojid);
+		      last_status = 1;
 		      return;
 	      }
 	      cur_pid = cur_job->pid;
@@ -441,7 +1109,8 @@ void do_bgfg(char **argv)
 	      // check for job
 	      cur_job = getjobpid(jobs, possible_pid);
 	      if (cur_job == NULL){
-		      printf("(%s) No such process\n",pidojid);
+		      printf("(%s): No such process\n",pidojid);
+		      last_status = 1;
 		      return;
 	      }
 	      cur_pid = cur_job->pid;
@@ -458,7 +1127,7 @@ void do_bgfg(char **argv)
       else if (strcmp(fgorbg, "bg") == 0){
 	      kill(-cur_pid, SIGCONT);
 	      cur_job->state = BG;
-	      printf("[%d] (%d) %s\n", cur_job->jid, cur_job->pid, cur_job->cmdline);
+	      printf("[%d] (%d) %s", cur_job->jid, cur_job->pid, cur_job->cmdline);
       }
 
       return;
@@ -469,15 +1138,24 @@ void do_bgfg(char **argv)
 void waitfg(pid_t pid)
 {
     struct job_t* job;
+    sigset_t mask, prev_mask;
     job = getjobpid(jobs,pid);
     //check if pid is valid
     if(pid == 0){
         return;
     }
     if(job != NULL){
-        //sleep
+        // sleep until SIGCHLD, running deadlines meanwhile; SIGCHLD is
+        // blocked except inside the wait so it can't slip in between
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGCHLD);
+        sigprocmask(SIG_BLOCK, &mask, &prev_mask);
+        notify('F', pid);
         while(pid==fgpid(jobs)){
+            waitevents(0, &prev_mask);
         }
+        finishjobs(); // it may have ended before the first wait
+        sigprocmask(SIG_SETMASK, &prev_mask, NULL);
     }
     return;
 }
@@ -518,20 +1196,46 @@ void sigchld_handler(int sig)
 {
 	int status;
 	pid_t pid;
+	struct rusage ru;
 	// passing -1 and WNOHANG checks for any zombie children
-	while ((pid=waitpid(-1, &status, WNOHANG|WUNTRACED)) > 0) {
-		int jid = pid2jid(pid);
+	while ((pid=wait4(-1, &status, WNOHANG|WUNTRACED, &ru)) > 0) {
+		// all of a pipeline's processes belong to its job
+		struct job_t *job = getjobproc(jobs, pid);
+		int jid = job != NULL ? job->jid : 0;
+		int i;
+		// remember how the foreground job ended for $? and if/while
+		if (job != NULL && job->state == FG && pid == job->tail)
+			last_status = WIFEXITED(status) ? WEXITSTATUS(status) :
+			    128 + (WIFSTOPPED(status) ? WSTOPSIG(status) : WTERMSIG(status));
 		// if statement is true when the process is stopped
+		notify(WIFSTOPPED(status) ? 'S' : WIFSIGNALED(status) ? 'T' : 'X', pid);
 		if (WIFSTOPPED(status)){
-			getjobpid(jobs, pid)->state = ST;
-		printf("Job [%d] (%d) Stopped by signal %d\n", jid, pid, WSTOPSIG(status));}
+			// reported once per job, however many processes stop
+			if (job != NULL && job->state != ST) {
+				job->state = ST;
+				printf("Job [%d] (%d) stopped by signal %d\n", jid, job->pid, WSTOPSIG(status));
+			}
+			continue;
+		}
 		// if statement true when process is terminated
-		else if (WIFSIGNALED(status)){
+		// (a pipeline stage that lost its reader is not news)
+		if (WIFSIGNALED(status) && (job == NULL || pid == job->pid) &&
+		    !(WTERMSIG(status) == SIGPIPE && job != NULL && pid != job->tail))
 			printf("Job [%d] (%d) terminated by signal %d\n", jid, pid, WTERMSIG(status));
-		deletejob(jobs, pid);}
-		// if statement true when the process is exited
-		else if (WIFEXITED(status)){
-		deletejob(jobs, pid);}
+		// the job is over when its last process or stage thread is
+		if (job == NULL)
+			continue;
+		for (i = 0; i < MAXSTAGES; i++)
+			if (job->procs[i] == pid)
+				job->procs[i] = 0;
+		// the job's usage is the most memory any of its processes
+		// used and the CPU time of all of them; finishjobs reports it
+		if (ru.ru_maxrss * 1024LL > job->mempeak)
+			job->mempeak = ru.ru_maxrss * 1024LL;
+		job->cpuusec += (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000LL +
+		    ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+		if (--job->nprocs == 0)
+			deletejob(jobs, job->pid);
 	}
 	return;
 }
@@ -567,6 +1271,26 @@ void sigtstp_handler(int sig)
     return;
 }
 
+/*
+ * initsignals - Install the signal handlers, once. An interactive
+ * shell does this at startup; a -c string only before its first fork,
+ * as until then there is no job for them to look after.
+ */
+void initsignals(void)
+{
+    if (sigsready)
+        return;
+    sigsready = 1;
+
+    /* These are the ones you will need to implement */
+    Signal(SIGINT,  sigint_handler);   /* ctrl-c */
+    Signal(SIGTSTP, sigtstp_handler);  /* ctrl-z */
+    Signal(SIGCHLD, sigchld_handler);  /* Terminated or stopped child */
+
+    /* This one provides a clean way to kill the shell */
+    Signal(SIGQUIT, sigquit_handler);
+}
+
 /*********************
  * End signal handlers
  *********************/
@@ -581,12 +1305,20 @@ void clearjob(struct job_t *job) {
     job->jid = 0;
     job->state = UNDEF;
     job->cmdline[0] = '\0';
+    job->limited = 0;
+    job->cgfd = -1;
+    memset(job->procs, 0, sizeof(job->procs));
+    job->nprocs = 0;
+    job->tail = 0;
+    job->mempeak = 0;
+    job->cpuusec = 0;
 }
 
-/* initjobs - Initialize the job list */
+/* initjobs - Initialize the job list (on the first addjob) */
 void initjobs(struct job_t *jobs) {
     int i;
 
+    jobsready = 1;
     for (i = 0; i < MAXJOBS; i++)
     clearjob(&jobs[i]);
 }
@@ -608,11 +1340,16 @@ int addjob(struct job_t *jobs, pid_t pid, int state, char *cmdline)
     int i;
     if (pid < 1)
     return 0;
+    if (!jobsready)
+    initjobs(jobs);
 
     for (i = 0; i < MAXJOBS; i++) {
     if (jobs[i].pid == 0) {
         jobs[i].pid = pid;
         jobs[i].state = state;
+        jobs[i].procs[0] = pid;
+        jobs[i].nprocs = 1;
+        jobs[i].tail = pid;
         jobs[i].jid = nextjid++;
         if (nextjid > MAXJOBS)
         nextjid = 1;
@@ -627,7 +1364,10 @@ int addjob(struct job_t *jobs, pid_t pid, int state, char *cmdline)
     return 0;
 }
 
-/* deletejob - Delete a job whose PID=pid from the job list */
+/*
+ * deletejob - Delete a job whose PID=pid from the job list, leaving
+ * the rest of the cleanup to finishjobs
+ */
 int deletejob(struct job_t *jobs, pid_t pid)
 {
     int i;
@@ -637,6 +1377,8 @@ int deletejob(struct job_t *jobs, pid_t pid)
 
     for (i = 0; i < MAXJOBS; i++) {
     if (jobs[i].pid == pid) {
+        if (ndone < MAXJOBS)
+            done[ndone++] = jobs[i];
         clearjob(&jobs[i]);
         nextjid = maxjid(jobs)+1;
         return 1;
@@ -645,6 +1387,32 @@ int deletejob(struct job_t *jobs, pid_t pid)
     return 0;
 }
 
+/*
+ * finishjobs - Clean up after the jobs deleted since the last call:
+ * drop their deadlines, and report a limited job's usage and remove
+ * its cgroup. deletejob is mostly called from the SIGCHLD handler,
+ * which must not touch the deadline heap or do file I/O; this runs
+ * in the main thread, before a job is added (so at most MAXJOBS can
+ * be waiting), after a foreground job and whenever the event loop
+ * wakes.
+ */
+void finishjobs(void)
+{
+    sigset_t mask, prev_mask;
+    int i;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &prev_mask);
+    for (i = 0; i < ndone; i++) {
+        dropdeadlines(done[i].pid, done[i].jid);
+        if (done[i].limited)
+            limitreap(&done[i]);
+    }
+    ndone = 0;
+    sigprocmask(SIG_SETMASK, &prev_mask, NULL);
+}
+
 /* fgpid - Return PID of current foreground job, 0 if no such job */
 pid_t fgpid(struct job_t *jobs) {
     int i;
@@ -667,6 +1435,19 @@ struct job_t *getjobpid(struct job_t *jobs, pid_t pid) {
     return NULL;
 }
 
+/* getjobproc - Find the job that process pid is part of */
+struct job_t *getjobproc(struct job_t *jobs, pid_t pid) {
+    int i, j;
+
+    if (pid < 1)
+    return NULL;
+    for (i = 0; i < MAXJOBS; i++)
+    for (j = 0; j < MAXSTAGES; j++)
+        if (jobs[i].procs[j] == pid)
+        return &jobs[i];
+    return NULL;
+}
+
 /* getjobjid  - Find a job (by JID) on the job list */
 struct job_t *getjobjid(struct job_t *jobs, int jid) 
 {
@@ -694,28 +1475,29 @@ int pid2jid(pid_t pid)
     return 0;
 }
 
-/* listjobs - Print the job list */
+/* listjobs - Print the job list, but not the pipeline a stage thread
+   running jobs belongs to */
 void listjobs(struct job_t *jobs)
 {
     int i;
     for (i = 0; i < MAXJOBS; i++) {
-    if (jobs[i].pid != 0) {
-        printf("[%d] (%d) ", jobs[i].jid, jobs[i].pid);
+    if (jobs[i].pid != 0 && jobs[i].pid != tjob) {
+        fprintf(OUT, "[%d] (%d) ", jobs[i].jid, jobs[i].pid);
         switch (jobs[i].state) {
         case BG:
-            printf("Running ");
+            fprintf(OUT, "Running ");
             break;
         case FG:
-            printf("Foreground ");
+            fprintf(OUT, "Foreground ");
             break;
         case ST:
-            printf("Stopped ");
+            fprintf(OUT, "Stopped ");
             break;
         default:
-            printf("listjobs: Internal error: job[%d].state=%d ", 
+            fprintf(OUT, "listjobs: Internal error: job[%d].state=%d ", 
                i, jobs[i].state);
         }
-        printf("%s", jobs[i].cmdline);
+        fprintf(OUT, "%s", jobs[i].cmdline);
     }
     }
 }
@@ -724,56 +1506,3526 @@ void listjobs(struct job_t *jobs)
  ******************************/
 
 
-/***********************
- * Other helper routines
- ***********************/
+/********************************
+ * Tokenizer scanning routines
+ ********************************/
 
 /*
- * usage - print a help message
+ * scanset(p, set) returns a pointer to the first byte of the string p
+ * that is in set, or to its terminating '\0'. It is how the tokenizer
+ * finds spaces, quotes, ';' and '$'. The vector versions classify
+ * 16 (SSE2) or 32 (AVX2) bytes per step. Their loads are aligned, so
+ * they never cross into a page the string does not touch, and bytes
+ * before p in the first block are masked off (which is also why
+ * AddressSanitizer is told to leave them alone). A set of more than
+ * MAXSET bytes is handed to scan_scalar. All versions return the same
+ * pointer for every input; tshscan.c checks that. scanset starts out
+ * pointing at scan_resolve, which picks the best one the CPU supports.
  */
-void usage(void)
+
+/* scan_scalar - Byte at a time scanset, the reference version */
+char *scan_scalar(const char *p, const char *set)
 {
-    printf("Usage: shell [-hvp]\n");
-    printf("   -h   print this message\n");
-    printf("   -v   print additional diagnostic information\n");
-    printf("   -p   do not emit a command prompt\n");
-    exit(1);
+    const char *s;
+
+    for (; *p; p++)
+        for (s = set; *s; s++)
+            if (*p == *s)
+                return (char *)p;
+    return (char *)p;
 }
 
-/*
- * unix_error - unix-style error routine
- */
-void unix_error(char *msg)
+#if defined(__x86_64__) || defined(__i386__)
+/* scan_sse2 - scanset 16 bytes at a time */
+__attribute__((target("sse2"), no_sanitize_address))
+static char *scan_sse2(const char *p, const char *set)
 {
-    fprintf(stdout, "%s: %s\n", msg, strerror(errno));
-    exit(1);
+    __m128i want[MAXSET], x, hit;
+    const char *a = (const char *)((uintptr_t)p & ~(uintptr_t)15);
+    unsigned mask;
+    int i, n;
+
+    for (n = 0; set[n] && n < MAXSET; n++)
+        want[n] = _mm_set1_epi8(set[n]);
+    if (set[n])
+        return scan_scalar(p, set);
+    x = _mm_load_si128((const __m128i *)a);
+    for (mask = ~0u << (p - a); ; a += 16, x = _mm_load_si128((const __m128i *)a), mask = ~0u) {
+        hit = _mm_cmpeq_epi8(x, _mm_setzero_si128());
+        for (i = 0; i < n; i++)
+            hit = _mm_or_si128(hit, _mm_cmpeq_epi8(x, want[i]));
+        if ((mask &= (unsigned)_mm_movemask_epi8(hit)) != 0)
+            return (char *)a + __builtin_ctz(mask);
+    }
 }
 
-/*
- * app_error - application-style error routine
- */
-void app_error(char *msg)
+/* scan_avx2 - scanset 32 bytes at a time */
+__attribute__((target("avx2"), no_sanitize_address))
+static char *scan_avx2(const char *p, const char *set)
 {
-    fprintf(stdout, "%s\n", msg);
-    exit(1);
+    __m256i want[MAXSET], x, hit;
+    const char *a = (const char *)((uintptr_t)p & ~(uintptr_t)31);
+    unsigned mask;
+    int i, n;
+
+    for (n = 0; set[n] && n < MAXSET; n++)
+        want[n] = _mm256_set1_epi8(set[n]);
+    if (set[n])
+        return scan_scalar(p, set);
+    x = _mm256_load_si256((const __m256i *)a);
+    for (mask = ~0u << (p - a); ; a += 32, x = _mm256_load_si256((const __m256i *)a), mask = ~0u) {
+        hit = _mm256_cmpeq_epi8(x, _mm256_setzero_si256());
+        for (i = 0; i < n; i++)
+            hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(x, want[i]));
+        if ((mask &= (unsigned)_mm256_movemask_epi8(hit)) != 0)
+            return (char *)a + __builtin_ctz(mask);
+    }
+}
+#endif
+
+/* scan_resolve - Pick a scanset for this CPU on the first call */
+static char *scan_resolve(const char *p, const char *set)
+{
+    scanset = scan_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        scanset = scan_avx2;
+    else if (__builtin_cpu_supports("sse2"))
+        scanset = scan_sse2;
+#endif
+    return scanset(p, set);
 }
+char *(*scanset)(const char *p, const char *set) = scan_resolve;
+/*************************************
+ * end tokenizer scanning routines
+ *************************************/
+
+
+/*********************************
+ * Shell variable helper routines
+ *********************************/
 
 /*
- * Signal - wrapper for the sigaction function
+ * The variables live in a chained hash table. Exported variables are
+ * also collected into envcache, the envp array handed to execve. The
+ * cache is only rebuilt after an exported variable changes, so
+ * spawning a command costs nothing per variable unless the command
+ * carries VAR=val overrides (see buildenvp).
  */
-handler_t *Signal(int signum, handler_t *handler)
+
+/* varhash - Hash the first len bytes of a variable name */
+static unsigned varhash(const char *name, int len)
 {
-    struct sigaction action, old_action;
+    unsigned h = 2166136261u;
+    int i;
 
-    action.sa_handler = handler;
-    sigemptyset(&action.sa_mask); /* block sigs of type being handled */
-    action.sa_flags = SA_RESTART; /* restart syscalls if possible */
+    for (i = 0; i < len; i++)
+        h = (h ^ (unsigned char)name[i]) * 16777619u;
+    return h & (VARBUCKETS - 1);
+}
 
-    if (sigaction(signum, &action, &old_action) < 0)
+/* initvars - Import the environment we were started with (on the
+   first use of a variable) */
+void initvars(void)
+{
+    char **ep;
+    char *eq;
+
+    varsready = 1;
+    for (ep = environ; *ep != NULL; ep++)
+        if ((eq = strchr(*ep, '=')) != NULL && eq != *ep)
+            setvar(*ep, eq - *ep, eq + 1, 1);
+}
+
+/* findvar - Find the variable whose name is the first len bytes of name */
+struct var_t *findvar(const char *name, int len)
+{
+    struct var_t *v;
+
+    if (!varsready)
+        initvars();
+    for (v = vars[varhash(name, len)]; v != NULL; v = v->next)
+        if (v->namelen == len && !strncmp(v->entry, name, len))
+            return v;
+    return NULL;
+}
+
+/* getvar - Return the value of a variable, NULL if it is not set */
+char *getvar(const char *name)
+{
+    struct var_t *v = findvar(name, strlen(name));
+
+    return v ? v->entry + v->namelen + 1 : NULL;
+}
+
+/*
+ * setvar - Set a variable. A variable stays exported once it has
+ * been exported; pass exported=1 to export it now.
+ */
+void setvar(const char *name, int len, const char *value, int exported)
+{
+    struct var_t *v = findvar(name, len);
+    char *entry;
+
+    if ((entry = malloc(len + strlen(value) + 2)) == NULL)
+        unix_error("setvar error");
+    memcpy(entry, name, len);
+    entry[len] = '=';
+    strcpy(entry + len + 1, value);
+
+    if (v == NULL) {
+        if ((v = calloc(1, sizeof(*v))) == NULL)
+            unix_error("setvar error");
+        v->namelen = len;
+        v->next = vars[varhash(name, len)];
+        vars[varhash(name, len)] = v;
+    }
+    else
+        free(v->entry);
+    v->entry = entry;
+    if (v->exported && !envdirty)
+        envcache[v->envidx] = entry; /* same slot, new string */
+    else if ((v->exported |= exported))
+        envdirty = 1;
+}
+
+/* unsetvar - Remove a variable */
+void unsetvar(const char *name)
+{
+    int len = strlen(name);
+    struct var_t **vp, *v;
+
+    if (!varsready)
+        initvars();
+    for (vp = &vars[varhash(name, len)]; (v = *vp) != NULL; vp = &v->next) {
+        if (v->namelen == len && !strncmp(v->entry, name, len)) {
+            *vp = v->next;
+            if (v->exported)
+                envdirty = 1;
+            free(v->entry);
+            free(v);
+            return;
+        }
+    }
+}
+
+/*
+ * buildenvp - Return the environment for a child. overrides[0..n-1]
+ * are "name=value" words that take the place of the exported variable
+ * of the same name. With no overrides this is the cached array;
+ * with some, a copy of it with their slots replaced.
+ */
+char **buildenvp(char **overrides, int n)
+{
+    struct var_t *v;
+    char **envp;
+    int i, j, k, len;
+
+    if (!varsready)
+        initvars();
+    if (envdirty) {
+        free(envcache);
+        envcount = 0;
+        for (i = 0; i < VARBUCKETS; i++)
+            for (v = vars[i]; v != NULL; v = v->next)
+                envcount += v->exported;
+        if ((envcache = malloc((envcount + 1) * sizeof(char *))) == NULL)
+            unix_error("buildenvp error");
+        for (i = 0, k = 0; i < VARBUCKETS; i++)
+            for (v = vars[i]; v != NULL; v = v->next)
+                if (v->exported) {
+                    v->envidx = k;
+                    envcache[k++] = v->entry;
+                }
+        envcache[k] = NULL;
+        envdirty = 0;
+    }
+    if (n == 0)
+        return envcache;
+
+    /* Layer the overrides on top; the strings themselves are shared */
+    if ((envp = malloc((envcount + n + 1) * sizeof(char *))) == NULL)
+        unix_error("buildenvp error");
+    memcpy(envp, envcache, envcount * sizeof(char *));
+    for (i = 0, k = envcount; i < n; i++) {
+        len = strchr(overrides[i], '=') - overrides[i];
+        if ((v = findvar(overrides[i], len)) != NULL && v->exported) {
+            envp[v->envidx] = overrides[i];
+            continue;
+        }
+        for (j = envcount; j < k && strncmp(envp[j], overrides[i], len + 1); j++)
+            ;
+        envp[j] = overrides[i];   /* a new name, or again */
+        k += (j == k);
+    }
+    envp[k] = NULL;
+    return envp;
+}
+
+/* isassign - Is word of the form NAME=value? */
+int isassign(const char *word)
+{
+    const char *p = word;
+
+    if (!isalpha((unsigned char)*p) && *p != '_')
+        return 0;
+    while (isalnum((unsigned char)*p) || *p == '_')
+        p++;
+    return *p == '=';
+}
+
+/*
+ * expandargs - Expand $NAME and ${NAME} in the unquoted words of argv.
+ * Expanded words are built in a static buffer that lives until the
+ * next call. Words that expand to nothing are dropped. Return -1 if
+ * the expansion does not fit.
+ */
+int expandargs(char **argv)
+{
+    static char xbuf[4*MAXLINE];
+    char *out = xbuf, *end = xbuf + sizeof(xbuf);
+    char *p, *word, *name, *val;
+    char num[16];
+    int i, k, len, braced;
+
+    for (i = 0, k = 0; argv[i] != NULL; i++) {
+        if (argquote[i] || *scanset(argv[i], "$") == '\0') {
+            argquote[k] = argquote[i];
+            argv[k++] = argv[i];
+            continue;
+        }
+        word = out;
+        for (p = argv[i]; *p; ) {
+            if (*p != '$') {
+                if (out == end)
+                    goto toolong;
+                *out++ = *p++;
+                continue;
+            }
+            braced = (p[1] == '{');
+            name = p + 1 + braced;
+            if (isdigit((unsigned char)*name) || *name == '?' || *name == '#')
+                len = 1;       /* special parameters are one character */
+            else
+                for (len = 0; isalnum((unsigned char)name[len]) || name[len] == '_'; len++)
+                    ;
+            if (len == 0 || (braced && name[len] != '}')) {
+                if (out == end)   /* not a variable, keep the '$' */
+                    goto toolong;
+                *out++ = *p++;
+                continue;
+            }
+            p = name + len + braced;
+            struct var_t *v = NULL;
+            val = NULL;
+            if (*name == '?')
+                sprintf(val = num, "%d", last_status);
+            else if (*name == '#')
+                sprintf(val = num, "%d", posc);
+            else if (isdigit((unsigned char)*name))
+                val = (*name - '0' <= posc) ? posv[*name - '0'] : NULL;
+            else if ((v = findvar(name, len)) != NULL)
+                val = v->entry + v->namelen + 1;
+            if (val != NULL) {
+                if (end - out < (long)strlen(val))
+                    goto toolong;
+                out = stpcpy(out, val);
+            }
+        }
+        if (out == end)
+            goto toolong;
+        *out++ = '\0';
+        if (*word != '\0') {
+            /* a value is only ever text, never a | or a redirection;
+               only an assignment keeps its meaning */
+            argquote[k] = !isassign(argv[i]);
+            argv[k++] = word;
+        }
+    }
+    argv[k] = NULL;
+    return 0;
+
+ toolong:
+    printf("%s: expansion too long\n", argv[i]);
+    return -1;
+}
+
+/*
+ * do_export - Execute the builtin export command
+ */
+void do_export(char **argv)
+{
+    struct var_t *v;
+    char *eq;
+    int i;
+
+    if (argv[1] == NULL) {
+        if (!varsready)
+            initvars();
+        for (i = 0; i < VARBUCKETS; i++)
+            for (v = vars[i]; v != NULL; v = v->next)
+                if (v->exported)
+                    fprintf(OUT, "export %s\n", v->entry);
+        return;
+    }
+    for (i = 1; argv[i] != NULL; i++) {
+        if ((eq = strchr(argv[i], '=')) != NULL && isassign(argv[i]))
+            setvar(argv[i], eq - argv[i], eq + 1, 1);
+        else if ((v = findvar(argv[i], strlen(argv[i]))) != NULL) {
+            if (!v->exported)
+                envdirty = 1;
+            v->exported = 1;
+        }
+        else if (strlen(argv[i]) < sizeof(sbuf) - 1 &&
+                 isassign(strcat(strcpy(sbuf, argv[i]), "=")))
+            setvar(argv[i], strlen(argv[i]), "", 1);
+        else
+            printf("export: %s: not a valid identifier\n", argv[i]);
+    }
+}
+/*************************************
+ * end shell variable helper routines
+ *************************************/
+
+
+/*****************************************
+ * Script compiler and interpreter routines
+ *****************************************/
+
+/*
+ * Input is compiled a line at a time into prog, a flat array of
+ * bytecode. Commands are tokenized once by cacheline and referenced
+ * from the code, so the body of a loop is never parsed again; only
+ * $VAR expansion happens each time a command runs. Jumps that are not
+ * yet known (the end of an if, the breaks out of a loop) are chained
+ * through their arg fields and patched when the block closes.
+ */
+
+/* hashline - FNV-1a hash of a string */
+static unsigned long hashline(const char *s)
+{
+    unsigned long h = 14695981039346656037ul;
+
+    while (*s)
+        h = (h ^ (unsigned char)*s++) * 1099511628211ul;
+    return h;
+}
+
+/* lruunlink - Take a line out of the parse cache's LRU list */
+static void lruunlink(struct pline_t *pl)
+{
+    *(pl->newer ? &pl->newer->older : &newest) = pl->older;
+    *(pl->older ? &pl->older->newer : &oldest) = pl->newer;
+}
+
+/* lrupush - Make a line the parse cache's most recently used */
+static void lrupush(struct pline_t *pl)
+{
+    pl->newer = NULL;
+    pl->older = newest;
+    *(newest ? &newest->newer : &oldest) = pl;
+    newest = pl;
+}
+
+/*
+ * lineevict - Free the least recently used line that no code in prog
+ * refers to. Lines that compiled code holds stay, however many.
+ */
+static void lineevict(void)
+{
+    struct pline_t *pl, **pp;
+
+    for (pl = oldest; pl != NULL && pl->refs > 0; pl = pl->newer)
+        ;
+    if (pl == NULL)
+        return;
+    for (pp = &lines[pl->hash & (LINEBUCKETS - 1)]; *pp != pl; pp = &(*pp)->next)
+        ;
+    *pp = pl->next;
+    lruunlink(pl);
+    free(pl);
+    nplines--;
+}
+
+/*
+ * cacheline - Return the tokenized form of cmdline, parsing it only
+ * the first time the line is seen.
+ */
+struct pline_t *cacheline(const char *cmdline)
+{
+    unsigned long h = hashline(cmdline);
+    struct pline_t *pl, **bucket = &lines[h & (LINEBUCKETS - 1)];
+    char *argv[MAXARGS];
+    char *p;
+    int i, bg, argc, size;
+
+    for (pl = *bucket; pl != NULL; pl = pl->next)
+        if (pl->hash == h && !strcmp(pl->text, cmdline)) {
+            lruunlink(pl);
+            lrupush(pl);
+            return pl;
+        }
+    if (nplines >= MAXPLINES)
+        lineevict();
+
+    bg = parseline(cmdline, argv);
+    for (argc = 0, size = 0; argv[argc] != NULL; argc++)
+        size += strlen(argv[argc]) + 1;
+
+    /* One allocation: the struct, argv, quote flags, text, words */
+    pl = malloc(sizeof(*pl) + (argc + 1) * sizeof(char *) + argc +
+                strlen(cmdline) + 1 + size);
+    if (pl == NULL)
+        unix_error("cacheline error");
+    pl->hash = h;
+    pl->argc = argc;
+    pl->bg = bg;
+    pl->argv = (char **)(pl + 1);
+    pl->quote = (char *)(pl->argv + argc + 1);
+    memcpy(pl->quote, argquote, argc);
+    pl->text = pl->quote + argc;
+    p = stpcpy(pl->text, cmdline) + 1;
+    for (i = 0; i < argc; i++) {
+        pl->argv[i] = p;
+        p = stpcpy(p, argv[i]) + 1;
+    }
+    pl->argv[argc] = NULL;
+    pl->refs = 0;
+    pl->next = *bucket;
+    *bucket = pl;
+    lrupush(pl);
+    nplines++;
+    return pl;
+}
+
+/* emit - Append an instruction to prog and return its address */
+static int emit(int op, int arg, char *name, struct pline_t *line)
+{
+    if (ncode == maxcode) {
+        maxcode = maxcode ? 2 * maxcode : 256;
+        if ((prog = realloc(prog, maxcode * sizeof(*prog))) == NULL)
+            unix_error("emit error");
+    }
+    prog[ncode].op = op;
+    prog[ncode].arg = arg;
+    prog[ncode].name = name;
+    prog[ncode].line = line;
+    if (line != NULL)
+        line->refs++;
+    return ncode++;
+}
+
+/*
+ * dropcode - Throw away the instructions from pc on, letting go of
+ * the lines they used
+ */
+void dropcode(int pc)
+{
+    while (ncode > pc)
+        if (prog[--ncode].line != NULL)
+            prog[ncode].line->refs--;
+}
+
+/* patch - Point every jump on chain at target */
+static void patch(int chain, int target)
+{
+    int next;
+
+    while (chain >= 0) {
+        next = prog[chain].arg;
+        prog[chain].arg = target;
+        chain = next;
+    }
+}
+
+/* emitline - Emit an instruction whose operand is the command text */
+static int emitline(int op, char *text)
+{
+    char buf[MAXLINE];
+
+    /* parseline and addjob keep MAXLINE bytes, newline and NUL included */
+    snprintf(buf, sizeof(buf), "%.*s\n", MAXLINE - 2, text);
+    return emit(op, -1, NULL, cacheline(buf));
+}
+
+/* innerloop - Return the innermost loop of the current function */
+static struct block_t *innerloop(void)
+{
+    int i;
+
+    for (i = depth - 1; i >= 0 && blocks[i].type != B_FUNC; i--)
+        if (blocks[i].type == B_WHILE || blocks[i].type == B_FOR)
+            return &blocks[i];
+    return NULL;
+}
+
+/* compileseg - Compile one ';'-separated segment of a line */
+static int compileseg(char *seg)
+{
+    struct block_t *b = depth ? &blocks[depth - 1] : NULL;
+    char *kw, *rest, *name, *split;
+    int k;
+
+    while (*seg == ' ' || *seg == '\t')
+        seg++;
+    if (*seg == '\0' || *seg == '#')
+        return 0;
+
+    /* Split off the first word, which may be a keyword */
+    kw = seg;
+    for (rest = seg; *rest && *rest != ' ' && *rest != '\t'; rest++)
+        ;
+    split = rest;
+    if (*rest)
+        *rest++ = '\0';
+    while (*rest == ' ' || *rest == '\t')
+        rest++;
+
+    if (!strcmp(kw, "if") || !strcmp(kw, "while")) {
+        if (*rest == '\0' || depth == MAXDEPTH)
+            goto error;
+        b = &blocks[depth++];
+        b->type = (kw[0] == 'i') ? B_IF : B_WHILE;
+        b->start = emitline(OP_CMD, rest);
+        b->jf = emit(OP_JF, -1, NULL, NULL);
+        b->ends = -1;
+    }
+    else if (!strcmp(kw, "elif")) {
+        if (b == NULL || b->type != B_IF || b->jf < 0 || *rest == '\0')
+            goto error;
+        b->ends = emit(OP_JMP, b->ends, NULL, NULL);
+        patch(b->jf, ncode);
+        emitline(OP_CMD, rest);
+        b->jf = emit(OP_JF, -1, NULL, NULL);
+    }
+    else if (!strcmp(kw, "else")) {
+        if (b == NULL || b->type != B_IF || b->jf < 0)
+            goto error;
+        b->ends = emit(OP_JMP, b->ends, NULL, NULL);
+        patch(b->jf, ncode);
+        b->jf = -1;
+        return compileseg(rest);
+    }
+    else if (!strcmp(kw, "then") || !strcmp(kw, "do")) {
+        if (b == NULL || (kw[0] == 't') != (b->type == B_IF) || b->type == B_FUNC)
+            goto error;
+        return compileseg(rest);
+    }
+    else if (!strcmp(kw, "fi")) {
+        if (b == NULL || b->type != B_IF || *rest)
+            goto error;
+        patch(b->jf, ncode);
+        patch(b->ends, ncode);
+        depth--;
+    }
+    else if (!strcmp(kw, "for")) {
+        /* for NAME in WORDS... */
+        name = rest;
+        for (k = 0; isalnum((unsigned char)name[k]) || name[k] == '_'; k++)
+            ;
+        if (k == 0 || strncmp(name + k, " in", 3) || (name[k+3] && name[k+3] != ' ') ||
+            depth == MAXDEPTH)
+            goto error;
+        name[k] = '\0';
+        emitline(OP_FORINIT, name + k + 3);
+        b = &blocks[depth++];
+        b->type = B_FOR;
+        b->start = b->jf = emit(OP_FORNEXT, -1, strdup(name), NULL);
+        b->ends = -1;
+    }
+    else if (!strcmp(kw, "done")) {
+        if (b == NULL || (b->type != B_WHILE && b->type != B_FOR) || *rest)
+            goto error;
+        emit(OP_JMP, b->start, NULL, NULL);
+        if (b->type == B_FOR)
+            emit(OP_FORPOP, -1, NULL, NULL);  /* loop exhausted or break */
+        patch(b->jf, ncode - (b->type == B_FOR));
+        patch(b->ends, ncode - (b->type == B_FOR));
+        depth--;
+    }
+    else if (!strcmp(kw, "break") || !strcmp(kw, "continue")) {
+        if ((b = innerloop()) == NULL || *rest)
+            goto error;
+        if (kw[0] == 'b')
+            b->ends = emit(OP_JMP, b->ends, NULL, NULL);
+        else
+            emit(OP_JMP, b->start, NULL, NULL);
+    }
+    else if (!strcmp(kw, "return")) {
+        for (k = depth - 1; k >= 0 && blocks[k].type != B_FUNC; k--)
+            ;
+        if (k < 0)
+            goto error;
+        emit(OP_RET, *rest ? atoi(rest) : -1, NULL, NULL);
+    }
+    else if (!strcmp(kw, "function") || (rest[0] == '(' && rest[1] == ')') ||
+             ((k = strlen(kw)) > 2 && !strcmp(kw + k - 2, "()"))) {
+        /* function NAME [{], NAME () [{] or NAME() [{] */
+        if (!strcmp(kw, "function")) {
+            name = rest;
+            for (rest = name; *rest && *rest != ' ' && *rest != '('; rest++)
+                ;
+            if (*rest)
+                *rest++ = '\0';
+        }
+        else
+            name = kw;
+        name[strcspn(name, "(")] = '\0';
+        rest += strspn(rest, "() \t");
+        if (*name == '\0' || depth == MAXDEPTH ||
+            (*rest && (rest[0] != '{' || (rest[1] && rest[1] != ' ' && rest[1] != '\t'))))
+            goto error;
+        b = &blocks[depth++];
+        b->type = B_FUNC;
+        b->start = emit(OP_DEFUN, -1, strdup(name), NULL);
+        b->jf = (*rest == '{');   /* seen the opening brace? */
+        keepcode = 1;
+        if (b->jf)
+            return compileseg(rest + 1);  /* f() { echo hi; } */
+    }
+    else if (!strcmp(kw, "{") && b != NULL && b->type == B_FUNC && !b->jf) {
+        b->jf = 1;
+        return compileseg(rest);
+    }
+    else if (!strcmp(kw, "}")) {
+        if (b == NULL || b->type != B_FUNC || !b->jf || *rest)
+            goto error;
+        emit(OP_RET, -1, NULL, NULL);
+        prog[b->start].arg = ncode;
+        depth--;
+    }
+    else {
+        if (*split == '\0' && *rest)
+            *split = ' ';     /* undo the split: this is a plain command */
+        emitline(OP_CMD, kw);
+    }
+    return 0;
+
+ error:
+    printf("syntax error near '%s'\n", kw);
+    return -1;
+}
+
+/*
+ * compileline - Compile a line of input into prog. Return -1 after a
+ * syntax error, in which case all open blocks are abandoned.
+ */
+int compileline(char *line)
+{
+    char buf[MAXLINE];
+    char *seg, *p;
+    int quoted = 0;
+
+    strncpy(buf, line, MAXLINE - 1);
+    buf[MAXLINE - 1] = '\0';
+    buf[strcspn(buf, "\n")] = '\0';
+
+    /* Split at unquoted ';' */
+    for (seg = p = buf; ; p++) {
+        p = scanset(p, quoted ? "'" : "';");
+        if (*p == '\'')
+            quoted = !quoted;
+        else {
+            int last = (*p == '\0');
+            *p = '\0';
+            if (compileseg(seg) < 0) {
+                depth = 0;
+                keepcode = 0;
+                return -1;
+            }
+            if (last)
+                return 0;
+            seg = p + 1;
+        }
+    }
+}
+
+/*
+ * packwords - Copy an argv into a single allocation, so that it
+ * survives later expansions.
+ */
+static char **packwords(char **argv)
+{
+    char **words, *p;
+    int n, size;
+
+    for (n = 0, size = 0; argv[n] != NULL; n++)
+        size += strlen(argv[n]) + 1;
+    if ((words = malloc((n + 1) * sizeof(char *) + size)) == NULL)
+        unix_error("packwords error");
+    p = (char *)(words + n + 1);
+    for (n = 0; argv[n] != NULL; n++) {
+        words[n] = p;
+        p = stpcpy(p, argv[n]) + 1;
+    }
+    words[n] = NULL;
+    return words;
+}
+
+/*
+ * run - The interpreter loop. Execute prog from pc until the end of
+ * the program or a return.
+ */
+void run(int pc)
+{
+    struct { char **words; int i; } fors[MAXDEPTH];
+    struct insn_t *ip;
+    struct func_t *fn;
+    char *argv[MAXARGS];
+    int nfor = 0;
+
+    while (pc < ncode) {
+        ip = &prog[pc++];
+        switch (ip->op) {
+        case OP_CMD:
+            tailexec = oneshot && pc == ncode && nfor == 0;
+            evalline(ip->line);
+            break;
+        case OP_JMP:
+            pc = ip->arg;
+            break;
+        case OP_JF:
+            if (last_status != 0)
+                pc = ip->arg;
+            break;
+        case OP_FORINIT:
+            memcpy(argv, ip->line->argv, (ip->line->argc + 1) * sizeof(char *));
+            memcpy(argquote, ip->line->quote, ip->line->argc);
+            if (expandargs(argv) < 0)
+                argv[0] = NULL;
+            fors[nfor].words = packwords(argv);
+            fors[nfor++].i = 0;
+            break;
+        case OP_FORNEXT:
+            if (fors[nfor-1].words[fors[nfor-1].i] == NULL)
+                pc = ip->arg;
+            else
+                setvar(ip->name, strlen(ip->name), fors[nfor-1].words[fors[nfor-1].i++], 0);
+            break;
+        case OP_FORPOP:
+            free(fors[--nfor].words);
+            break;
+        case OP_DEFUN:
+            if ((fn = findfunc(ip->name)) == NULL) {
+                if ((fn = malloc(sizeof(*fn))) == NULL)
+                    unix_error("run error");
+                fn->name = ip->name;
+                fn->next = funcs;
+                funcs = fn;
+            }
+            fn->pc = pc;
+            pc = ip->arg;
+            break;
+        case OP_RET:
+            if (ip->arg >= 0)
+                last_status = ip->arg;
+            pc = ncode;
+            break;
+        }
+    }
+    while (nfor > 0)
+        free(fors[--nfor].words);
+}
+
+/* findfunc - Find a shell function by name */
+struct func_t *findfunc(const char *name)
+{
+    struct func_t *fn;
+
+    for (fn = funcs; fn != NULL; fn = fn->next)
+        if (!strcmp(fn->name, name))
+            return fn;
+    return NULL;
+}
+
+/* callfunc - Run a shell function with argv as its positional parameters */
+void callfunc(struct func_t *fn, char **argv)
+{
+    char **savev = posv;
+    int savec = posc;
+
+    posv = packwords(argv);
+    for (posc = 0; posv[posc + 1] != NULL; posc++)
+        ;
+    run(fn->pc);
+    free(posv);
+    posv = savev;
+    posc = savec;
+}
+
+/*
+ * runscript - Compile the script in path and run it
+ */
+void runscript(char *path)
+{
+    char line[MAXLINE];
+    FILE *fp;
+    int lineno = 0;
+
+    if ((fp = fopen(path, "r")) == NULL) {
+        printf("%s: %s\n", path, strerror(errno));
+        exit(127);
+    }
+    while (fgets(line, MAXLINE, fp) != NULL) {
+        lineno++;
+        if (compileline(line) < 0) {
+            printf("%s: line %d\n", path, lineno);
+            exit(2);
+        }
+    }
+    fclose(fp);
+    if (depth > 0) {
+        printf("%s: unexpected end of file\n", path);
+        exit(2);
+    }
+    run(0);
+}
+
+/*
+ * runstring - Compile a -c command string and run it
+ */
+void runstring(char *text)
+{
+    char line[MAXLINE];
+    int lineno = 0, n;
+
+    while (*text != '\0') {
+        lineno++;
+        n = strcspn(text, "\n");
+        snprintf(line, sizeof(line), "%.*s\n", n < MAXLINE - 2 ? n : MAXLINE - 2, text);
+        text += n + (text[n] == '\n');
+        if (compileline(line) < 0) {
+            printf("-c: line %d\n", lineno);
+            exit(2);
+        }
+    }
+    if (depth > 0) {
+        printf("-c: unexpected end of string\n");
+        exit(2);
+    }
+    run(0);
+}
+
+/*
+ * do_test - Execute the builtin test (or [) command. Return 0 if the
+ * condition holds and 1 if it does not.
+ */
+int do_test(char **argv)
+{
+    struct stat st;
+    int argc, neg = 0;
+    long a, b;
+    char *op;
+
+    for (argc = 1; argv[argc] != NULL; argc++)
+        ;
+    if (argv[0][0] == '[') {
+        if (strcmp(argv[argc-1], "]")) {
+            fprintf(OUT, "[: missing ]\n");
+            return 2;
+        }
+        argv[--argc] = NULL;
+    }
+    argv++, argc--;
+    if (argc > 0 && !strcmp(argv[0], "!"))
+        neg = 1, argv++, argc--;
+
+    switch (argc) {
+    case 0:
+        return !neg;
+    case 1:
+        return (argv[0][0] == '\0') != neg;
+    case 2:
+        op = argv[0];
+        if (!strcmp(op, "-n"))
+            return (argv[1][0] == '\0') != neg;
+        if (!strcmp(op, "-z"))
+            return (argv[1][0] != '\0') != neg;
+        if (!strcmp(op, "-e") || !strcmp(op, "-f") || !strcmp(op, "-d")) {
+            if (stat(argv[1], &st) < 0)
+                return !neg;
+            if (op[1] == 'f')
+                return S_ISREG(st.st_mode) == neg;
+            if (op[1] == 'd')
+                return S_ISDIR(st.st_mode) == neg;
+            return neg;
+        }
+        break;
+    case 3:
+        op = argv[1];
+        if (!strcmp(op, "="))
+            return (strcmp(argv[0], argv[2]) != 0) != neg;
+        if (!strcmp(op, "!="))
+            return (strcmp(argv[0], argv[2]) == 0) != neg;
+        a = atol(argv[0]);
+        b = atol(argv[2]);
+        if (!strcmp(op, "-eq")) return (a == b) == neg;
+        if (!strcmp(op, "-ne")) return (a != b) == neg;
+        if (!strcmp(op, "-lt")) return (a < b) == neg;
+        if (!strcmp(op, "-le")) return (a <= b) == neg;
+        if (!strcmp(op, "-gt")) return (a > b) == neg;
+        if (!strcmp(op, "-ge")) return (a >= b) == neg;
+        break;
+    }
+    fprintf(OUT, "test: unknown condition\n");
+    return 2;
+}
+/*********************************************
+ * end script compiler and interpreter routines
+ *********************************************/
+
+
+/*****************************
+ * Event loop and deadlines
+ *****************************/
+
+/*
+ * The shell sleeps in exactly two places: waiting for input and
+ * waiting for a foreground job. Both go through waitevents, which
+ * blocks in epoll_pwait once any deadline has been set. Deadlines are
+ * kept in a binary heap and a single timerfd is armed for the soonest
+ * one, so there is no extra process or signal per timed job.
+ */
+
+/*
+ * readcmdline - Read a line from standard input into buf. Return its
+ * length, or 0 at end of file. A last line without a newline gets one.
+ */
+int readcmdline(char *buf, int size)
+{
+    static char in[4*MAXLINE];
+    static int start, end, eof;
+    char *nl;
+    int n;
+
+    while (1) {
+        nl = memchr(in + start, '\n', end - start);
+        if (nl != NULL || end - start >= size - 2 || (eof && end > start)) {
+            n = nl ? nl - (in + start) + 1 : end - start;
+            if (n > size - 2)
+                n = size - 2;
+            memcpy(buf, in + start, n);
+            start += n;
+            if (buf[n-1] != '\n')
+                buf[n++] = '\n';
+            buf[n] = '\0';
+            return n;
+        }
+        if (eof)
+            return 0;
+        memmove(in, in + start, end - start);
+        end -= start;
+        start = 0;
+
+        waitevents(1, NULL);
+        if ((n = read(STDIN_FILENO, in + end, sizeof(in) - end)) < 0) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            unix_error("read error");
+        }
+        if (n == 0)
+            eof = 1;
+        end += n;
+    }
+}
+
+/* initevents - Create the event loop's epoll instance and timerfd */
+void initevents(void)
+{
+    struct epoll_event ev;
+
+    if (evfd >= 0)
+        return;
+    if ((evfd = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+        (tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
+        unix_error("initevents error");
+    ev.events = EPOLLIN;
+    ev.data.u64 = EV_TIMER;
+    if (epoll_ctl(evfd, EPOLL_CTL_ADD, tfd, &ev) < 0)
+        unix_error("initevents error");
+}
+
+/* nowns - Return the CLOCK_MONOTONIC time in nanoseconds */
+long long nowns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * poolwait - epoll_pwait for waitevents once there are stage threads.
+ * They may use the shell's state while we sleep, so statelock is let
+ * go; the signal handlers, which change that state too, are held off
+ * (sigfd still wakes us) and run once we have the lock back.
+ */
+static int poolwait(struct epoll_event *evs, int timeout, sigset_t *waitmask)
+{
+    sigset_t runmask, sleepmask, prev;
+    int n, err;
+
+    if (waitmask != NULL)
+        runmask = *waitmask;
+    else
+        pthread_sigmask(SIG_BLOCK, NULL, &runmask);
+    sleepmask = runmask;
+    sigaddset(&sleepmask, SIGCHLD);
+    sigaddset(&sleepmask, SIGINT);
+    sigaddset(&sleepmask, SIGTSTP);
+    pthread_mutex_unlock(&statelock);
+    n = epoll_pwait(evfd, evs, 8, timeout, &sleepmask);
+    err = errno;
+    pthread_mutex_lock(&statelock);
+    pthread_sigmask(SIG_SETMASK, &runmask, &prev); /* the handlers run here */
+    pthread_sigmask(SIG_SETMASK, &prev, NULL);
+    errno = err;
+    return n;
+}
+
+/*
+ * waitevents - Wait for standard input to become readable (if
+ * wantinput) or for a signal, firing deadlines as they fall due.
+ * If waitmask is not NULL it is the signal mask to wait with.
+ */
+void waitevents(int wantinput, sigset_t *waitmask)
+{
+    struct epoll_event ev, evs[8];
+    int i, n, polled = 0;
+
+    if (evfd < 0) {
+        /* No deadline was ever set: just block */
+        if (!wantinput)
+            sigsuspend(waitmask);
+        finishjobs();
+        return;
+    }
+    if (wantinput) {
+        ev.events = EPOLLIN;
+        ev.data.u64 = EV_INPUT;
+        if (epoll_ctl(evfd, EPOLL_CTL_ADD, STDIN_FILENO, &ev) == 0)
+            polled = 1;
+        /* else a regular file, always readable: just catch up on events */
+    }
+    fflush(stdout);
+    while (1) {
+        if (npool > 0)
+            n = poolwait(evs, (wantinput && !polled) ? 0 : -1, waitmask);
+        else
+            n = epoll_pwait(evfd, evs, 8, (wantinput && !polled) ? 0 : -1, waitmask);
+        if (n < 0 && errno != EINTR)
+            unix_error("epoll_pwait error");
+        for (i = 0; i < n; i++) {
+            if (evs[i].data.u64 == EV_TIMER)
+                firedeadlines();
+            else if (evs[i].data.u64 == EV_POOL)
+                stagedone();
+            else if (evs[i].data.u64 == EV_SIGNAL)
+                ;   /* poolwait has run the handlers */
+            else if (evs[i].data.u64 >= EV_MEMO && evs[i].data.u64 < EV_MEMO + 2 * MAXMEMOS)
+                memodrain(&memos[(evs[i].data.u64 - EV_MEMO) / 2],
+                          (evs[i].data.u64 - EV_MEMO) % 2 + 1);
+            else if (evs[i].data.u64 != EV_INPUT)
+                drainspool(&spools[evs[i].data.u64]);
+        }
+        finishjobs();
+        if (!wantinput || !polled || n < 0)
+            break;
+        for (i = 0; i < n && evs[i].data.u64 != EV_INPUT; i++)
+            ;
+        if (i < n)
+            break;
+    }
+    if (polled)
+        epoll_ctl(evfd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+}
+
+/* armtimer - Set the timerfd for the soonest deadline */
+static void armtimer(void)
+{
+    struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+
+    if (ntimers > 0) {
+        its.it_value.tv_sec = timers[0].when / 1000000000LL;
+        its.it_value.tv_nsec = timers[0].when % 1000000000LL;
+        if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+            its.it_value.tv_nsec = 1;    /* zero would disarm it */
+    }
+    if (timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+        unix_error("timerfd_settime error");
+}
+
+/*
+ * adddeadline - Send sig to job pid's process group at time when, and
+ * SIGKILL killafter ns later if killafter > 0
+ */
+void adddeadline(pid_t pid, long long when, int sig, long long killafter)
+{
+    struct deadline_t d;
+    int i, parent;
+
+    initevents();
+    if (ntimers == maxtimers) {
+        maxtimers = maxtimers ? 2 * maxtimers : 64;
+        if ((timers = realloc(timers, maxtimers * sizeof(*timers))) == NULL)
+            unix_error("adddeadline error");
+    }
+    d.when = when;
+    d.pid = pid;
+    d.jid = pid2jid(pid);
+    d.sig = sig;
+    d.killafter = killafter;
+
+    /* Sift up */
+    for (i = ntimers++; i > 0 && timers[parent = (i - 1) / 2].when > when; i = parent)
+        timers[i] = timers[parent];
+    timers[i] = d;
+    if (i == 0)
+        armtimer();
+}
+
+/* siftdown - Put d in the heap's hole at i, moving it down into place */
+static void siftdown(int i, struct deadline_t d)
+{
+    int child;
+
+    while ((child = 2 * i + 1) < ntimers) {
+        if (child + 1 < ntimers && timers[child + 1].when < timers[child].when)
+            child++;
+        if (d.when <= timers[child].when)
+            break;
+        timers[i] = timers[child];
+        i = child;
+    }
+    timers[i] = d;
+}
+
+/* popdeadline - Remove the soonest deadline from the heap */
+static void popdeadline(void)
+{
+    ntimers--;
+    siftdown(0, timers[ntimers]);
+}
+
+/*
+ * dropdeadlines - Remove the deadlines of job jid (PID pid), which is
+ * over, so that they neither wake the shell nor stop a tail exec
+ */
+void dropdeadlines(pid_t pid, int jid)
+{
+    int i, n;
+
+    for (i = n = 0; i < ntimers; i++)
+        if (timers[i].pid != pid || timers[i].jid != jid)
+            timers[n++] = timers[i];
+    if (n == ntimers)
+        return;
+    ntimers = n;
+    for (i = n / 2 - 1; i >= 0; i--)
+        siftdown(i, timers[i]);
+    armtimer();
+}
+
+/*
+ * firedeadlines - Signal every job whose deadline has passed. Jobs
+ * that have already finished are skipped.
+ */
+void firedeadlines(void)
+{
+    uint64_t expirations;
+    long long now = nowns();
+    struct deadline_t d;
+    struct job_t *job;
+
+    read(tfd, &expirations, sizeof(expirations));
+    while (ntimers > 0 && timers[0].when <= now) {
+        d = timers[0];
+        popdeadline();
+        job = getjobpid(jobs, d.pid);
+        if (job == NULL || job->jid != d.jid)
+            continue;
+        if (verbose)
+            printf("Job [%d] (%d) deadline passed, sending signal %d\n", d.jid, d.pid, d.sig);
+        kill(-d.pid, d.sig);
+        if (d.killafter > 0)
+            adddeadline(d.pid, now + d.killafter, SIGKILL, 0);
+    }
+    armtimer();
+}
+
+/*
+ * parseduration - Parse a duration such as 10, 2.5s, 3m, 1h or 1d
+ * into nanoseconds. Return -1 if s is not a duration, or not a
+ * finite one of less than about 146 years.
+ */
+int parseduration(const char *s, long long *ns)
+{
+    char *end;
+    double secs = strtod(s, &end);
+
+    if (end == s)
+        return -1;
+    switch (*end) {
+    case '\0': case 's': break;
+    case 'm': secs *= 60; break;
+    case 'h': secs *= 3600; break;
+    case 'd': secs *= 86400; break;
+    default: return -1;
+    }
+    /* also false for nan; the bound keeps now + *ns from overflowing */
+    if ((*end && end[1]) || !(secs >= 0 && secs * 1e9 < LLONG_MAX / 2))
+        return -1;
+    *ns = (long long)(secs * 1e9);
+    return 0;
+}
+
+/* parsesig - Parse a signal name (TERM, SIGTERM) or number, -1 if bad */
+int parsesig(const char *s)
+{
+    static struct { char *name; int sig; } sigs[] = {
+        { "HUP", SIGHUP }, { "INT", SIGINT }, { "QUIT", SIGQUIT },
+        { "KILL", SIGKILL }, { "USR1", SIGUSR1 }, { "USR2", SIGUSR2 },
+        { "ALRM", SIGALRM }, { "TERM", SIGTERM }, { "CONT", SIGCONT },
+        { "STOP", SIGSTOP }, { "TSTP", SIGTSTP },
+    };
+    unsigned i;
+
+    if (isdigit((unsigned char)*s))
+        return atoi(s) > 0 && atoi(s) < NSIG ? atoi(s) : -1;
+    if (!strncmp(s, "SIG", 3))
+        s += 3;
+    for (i = 0; i < sizeof(sigs) / sizeof(sigs[0]); i++)
+        if (!strcmp(s, sigs[i].name))
+            return sigs[i].sig;
+    return -1;
+}
+
+/*
+ * parsetimeout - Parse "timeout DURATION [-s SIG] [-k KILLAFTER]" at
+ * the front of argv into d (with d->when relative). A DURATION of 0
+ * means no timeout, as with timeout(1). Return the number of words
+ * used, or -1 after printing an error.
+ */
+int parsetimeout(char **argv, struct deadline_t *d)
+{
+    int i = 1;
+
+    d->sig = SIGTERM;
+    d->killafter = 0;
+    while (argv[i] != NULL && argv[i+1] != NULL && argv[i][0] == '-') {
+        if (!strcmp(argv[i], "-s") && (d->sig = parsesig(argv[i+1])) > 0)
+            i += 2;
+        else if (!strcmp(argv[i], "-k") && parseduration(argv[i+1], &d->killafter) == 0)
+            i += 2;
+        else
+            goto error;
+    }
+    if (argv[i] == NULL || parseduration(argv[i], &d->when) < 0)
+        goto error;
+    /* options may also follow the duration, as with timeout(1) */
+    while (argv[++i] != NULL && argv[i+1] != NULL && argv[i][0] == '-') {
+        if (!strcmp(argv[i], "-s") && (d->sig = parsesig(argv[i+1])) > 0)
+            i++;
+        else if (!strcmp(argv[i], "-k") && parseduration(argv[i+1], &d->killafter) == 0)
+            i++;
+        else
+            goto error;
+    }
+    if (argv[i] == NULL)
+        goto error;
+    return i;
+
+ error:
+    printf("usage: timeout DURATION [-s SIG] [-k KILLAFTER] command\n");
+    return -1;
+}
+
+/*
+ * do_deadline - Execute the builtin deadline command:
+ *     deadline [-s SIG] %jid|pid DURATION
+ */
+void do_deadline(char **argv)
+{
+    struct job_t *job;
+    long long when;
+    int sig = SIGTERM;
+
+    if (argv[1] != NULL && !strcmp(argv[1], "-s")) {
+        if (argv[2] == NULL || (sig = parsesig(argv[2])) < 0) {
+            printf("deadline: bad signal\n");
+            last_status = 1;
+            return;
+        }
+        argv += 2;
+    }
+    if (argv[1] == NULL || argv[2] == NULL || parseduration(argv[2], &when) < 0) {
+        printf("usage: deadline [-s SIG] %%jobid|pid DURATION\n");
+        last_status = 1;
+        return;
+    }
+    if (argv[1][0] == '%')
+        job = getjobjid(jobs, atoi(argv[1] + 1));
+    else
+        job = getjobpid(jobs, atoi(argv[1]));
+    if (job == NULL) {
+        printf("%s: No such job\n", argv[1]);
+        last_status = 1;
+        return;
+    }
+    adddeadline(job->pid, nowns() + when, sig, 0);
+}
+/*********************************
+ * end event loop and deadlines
+ *********************************/
+
+
+/*************************
+ * Output capture routines
+ *************************/
+
+/*
+ * With capture on, a background job's stdout and stderr both go to a
+ * pipe. The event loop drains the pipe in SPOOLCHUNK reads into a
+ * memfd spool, so nothing the job writes is lost however slowly the
+ * terminal takes it. Complete lines are copied from the spool to our
+ * stdout with a "[jid] " tag in front, many lines per writev; in
+ * group mode that only happens once the job closes its end. joblog
+ * replays a spool in full, also after the job is gone.
+ */
+
+/* addspool - Start capturing job pid's output from pipe fd */
+void addspool(pid_t pid, int fd)
+{
+    struct spool_t *sp = NULL;
+    struct epoll_event ev;
+    int i;
+
+    /* Take a free slot, else the oldest finished one */
+    for (i = 0; i < MAXSPOOLS; i++) {
+        if (spools[i].jid == 0) {
+            sp = &spools[i];
+            break;
+        }
+        if (spools[i].fd < 0 && (sp == NULL || spools[i].seq < sp->seq))
+            sp = &spools[i];
+    }
+    if (sp == NULL) {
+        printf("Too many captured jobs, output of (%d) is discarded\n", pid);
+        close(fd);
+        return;
+    }
+    if (sp->jid != 0)
+        close(sp->memfd);
+    if ((sp->memfd = memfd_create("tsh-spool", MFD_CLOEXEC)) < 0)
+        unix_error("memfd_create error");
+    sp->jid = pid2jid(pid);
+    sp->pid = pid;
+    sp->fd = fd;
+    sp->size = sp->emitted = 0;
+    sp->mode = capmode;
+    sp->seq = ++spoolseq;
+    sprintf(sp->tag, "[%d] ", sp->jid);
+
+    initevents();
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    ev.events = EPOLLIN;
+    ev.data.u64 = sp - spools;
+    if (epoll_ctl(evfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        unix_error("epoll_ctl error");
+}
+
+/* writeall - writev all of iov[0..n-1] to fd */
+static void writeall(int fd, struct iovec *iov, int n)
+{
+    ssize_t rc;
+
+    while (n > 0) {
+        if ((rc = writev(fd, iov, n)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        while (n > 0 && (size_t)rc >= iov->iov_len) {
+            rc -= iov->iov_len;
+            iov++, n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char *)iov->iov_base + rc;
+            iov->iov_len -= rc;
+        }
+    }
+}
+
+/*
+ * emitspool - Show the unshown lines of a spool, tagged. A trailing
+ * partial line waits for the rest unless final is set.
+ */
+static void emitspool(struct spool_t *sp, int final)
+{
+    static char buf[SPOOLCHUNK];
+    struct iovec iov[IOV_MAX];
+    char *p, *nl, *end;
+    ssize_t n;
+    int k;
+
+    while (sp->emitted < sp->size) {
+        n = sp->size - sp->emitted;
+        if (n > SPOOLCHUNK)
+            n = SPOOLCHUNK;
+        if ((n = pread(sp->memfd, buf, n, sp->emitted)) <= 0)
+            return;
+        end = buf + n;
+        for (p = buf, k = 0; p < end; p = nl + 1) {
+            if ((nl = memchr(p, '\n', end - p)) == NULL) {
+                /* A partial line is shown at the very end, or if it
+                   fills buf; otherwise wait for the rest of it */
+                if (!(final && sp->emitted + n == sp->size) &&
+                    !(p == buf && n == SPOOLCHUNK))
+                    break;
+                nl = end - 1;
+            }
+            iov[k].iov_base = sp->tag;
+            iov[k++].iov_len = strlen(sp->tag);
+            iov[k].iov_base = p;
+            iov[k++].iov_len = nl + 1 - p;
+            if (*nl != '\n') {
+                iov[k].iov_base = "\n";
+                iov[k++].iov_len = 1;
+            }
+            if (k > IOV_MAX - 3) {
+                writeall(STDOUT_FILENO, iov, k);
+                k = 0;
+            }
+        }
+        writeall(STDOUT_FILENO, iov, k);
+        if (p == buf)
+            return;
+        sp->emitted += p - buf;
+    }
+}
+
+/*
+ * drainspool - Read everything available from a job's pipe into its
+ * spool, and show what the capture mode allows
+ */
+void drainspool(struct spool_t *sp)
+{
+    static char buf[SPOOLCHUNK];
+    ssize_t n;
+
+    fflush(stdout);
+    while ((n = read(sp->fd, buf, sizeof(buf))) > 0) {
+        if (pwrite(sp->memfd, buf, n, sp->size) != n)
+            unix_error("spool write error");
+        sp->size += n;
+        if (sp->mode == CAP_TAG)
+            emitspool(sp, 0);
+    }
+    if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+        /* The job (and anything it started) closed its output */
+        epoll_ctl(evfd, EPOLL_CTL_DEL, sp->fd, NULL);
+        close(sp->fd);
+        sp->fd = -1;
+        emitspool(sp, 1);
+    }
+}
+
+/*
+ * do_capture - Execute the builtin capture command:
+ *     capture [on|off|--group]
+ */
+void do_capture(char **argv)
+{
+    if (argv[1] == NULL)
+        printf("capture %s\n", capmode == CAP_OFF ? "off" : capmode == CAP_TAG ? "on" : "--group");
+    else if (!strcmp(argv[1], "on"))
+        capmode = CAP_TAG;
+    else if (!strcmp(argv[1], "off"))
+        capmode = CAP_OFF;
+    else if (!strcmp(argv[1], "--group"))
+        capmode = CAP_GROUP;
+    else {
+        printf("usage: capture [on|off|--group]\n");
+        last_status = 1;
+    }
+}
+
+/*
+ * do_joblog - Execute the builtin joblog command: joblog %jid|pid.
+ * Return its status.
+ */
+int do_joblog(char **argv)
+{
+    static char buf[SPOOLCHUNK];
+    struct spool_t *sp = NULL;
+    struct iovec iov;
+    off_t off;
+    ssize_t n;
+    int i, jid = 0;
+    pid_t pid = 0;
+
+    if (argv[1] == NULL) {
+        fprintf(OUT, "usage: joblog %%jobid|pid\n");
+        return 1;
+    }
+    if (argv[1][0] == '%')
+        jid = atoi(argv[1] + 1);
+    else
+        pid = atoi(argv[1]);
+    for (i = 0; i < MAXSPOOLS; i++)
+        if (spools[i].jid != 0 && (jid ? spools[i].jid == jid : spools[i].pid == pid) &&
+            (sp == NULL || spools[i].seq > sp->seq))
+            sp = &spools[i];
+    if (sp == NULL) {
+        fprintf(OUT, "%s: No captured output\n", argv[1]);
+        return 1;
+    }
+    if (sp->fd >= 0)
+        drainspool(sp);
+    fflush(OUT);
+    for (off = 0; off < sp->size && (n = pread(sp->memfd, buf, sizeof(buf), off)) > 0; off += n) {
+        iov.iov_base = buf;
+        iov.iov_len = n;
+        if (tout != NULL)
+            fwrite(buf, 1, n, tout);
+        else
+            writeall(STDOUT_FILENO, &iov, 1);
+    }
+    return 0;
+}
+/*****************************
+ * end output capture routines
+ *****************************/
+
+
+/*************************
+ * Resource limit routines
+ *************************/
+
+/*
+ * "limit [--mem SIZE] [--cpu CPUS] [--pids N] command" runs the job
+ * in a cgroup of its own, made under the delegated cgroup v2
+ * directory $TSH_CGROUP (default: the shell's own cgroup, which only
+ * works if the shell is not itself a member). The memory, cpu and
+ * pids controllers then hold the whole job to its limits, and when
+ * the job is reaped its peak memory, CPU time and OOM kills are read
+ * into the job record and reported. Without a usable cgroup, each
+ * process of the job gets setrlimit instead: RLIMIT_AS for memory
+ * (so a pipeline may use that much per stage), RLIMIT_NPROC for pids
+ * (which counts all of the user's processes) and nothing for CPU,
+ * with a warning; the figures then come from wait4, taking the
+ * largest peak of the job's processes and the sum of their CPU time
+ * (stage threads run in the shell and are not counted).
+ */
+
+/* parsesize - Parse a byte count with an optional K, M, G or T suffix */
+static int parsesize(const char *s, long long *bytes)
+{
+    char *end;
+    double n = strtod(s, &end);
+
+    if (end == s || n <= 0)
+        return -1;
+    switch (toupper((unsigned char)*end)) {
+    case '\0': break;
+    case 'K': n *= 1LL << 10; break;
+    case 'M': n *= 1LL << 20; break;
+    case 'G': n *= 1LL << 30; break;
+    case 'T': n *= 1LL << 40; break;
+    default: return -1;
+    }
+    if (*end && end[1] && strcasecmp(end + 1, "B"))
+        return -1;
+    *bytes = (long long)n;
+    return 0;
+}
+
+/*
+ * parselimit - Parse "limit [--mem SIZE] [--cpu CPUS] [--pids N]" at
+ * the front of argv into l. Return the number of words used, or -1
+ * after printing an error.
+ */
+int parselimit(char **argv, struct limit_t *l)
+{
+    char *end;
+    double cpus;
+    int i;
+
+    for (i = 1; argv[i] != NULL && argv[i+1] != NULL && !strncmp(argv[i], "--", 2); i += 2) {
+        if (!strcmp(argv[i], "--mem")) {
+            if (parsesize(argv[i+1], &l->mem) < 0)
+                goto error;
+        }
+        else if (!strcmp(argv[i], "--cpu")) {
+            cpus = strtod(argv[i+1], &end);
+            if (end == argv[i+1] || *end || cpus <= 0)
+                goto error;
+            l->cpu = (long long)(cpus * 100000);
+        }
+        else if (!strcmp(argv[i], "--pids")) {
+            l->pids = strtoll(argv[i+1], &end, 10);
+            if (end == argv[i+1] || *end || l->pids <= 0)
+                goto error;
+        }
+        else
+            goto error;
+    }
+    if (i == 1 || argv[i] == NULL)
+        goto error;
+    l->on = 1;
+    return i;
+
+ error:
+    printf("usage: limit [--mem SIZE] [--cpu CPUS] [--pids N] command\n");
+    return -1;
+}
+
+/* cgwrite - Write val to file in cgroup directory dfd */
+static int cgwrite(int dfd, const char *file, const char *val)
+{
+    int fd, n;
+
+    if ((fd = openat(dfd, file, O_WRONLY | O_CLOEXEC)) < 0)
+        return -1;
+    n = write(fd, val, strlen(val));
+    close(fd);
+    return n < 0 ? -1 : 0;
+}
+
+/*
+ * cgread - Read a number from file in cgroup directory dfd: the whole
+ * file, or the value on the line starting with key. -1 if missing.
+ */
+static long long cgread(int dfd, const char *file, const char *key)
+{
+    char buf[1024], *p;
+    int fd, n;
+
+    if ((fd = openat(dfd, file, O_RDONLY | O_CLOEXEC)) < 0)
+        return -1;
+    n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0)
+        return -1;
+    buf[n] = '\0';
+    for (p = buf; key != NULL; p++) {
+        if (!strncmp(p, key, strlen(key)) && p[strlen(key)] == ' ') {
+            p += strlen(key);
+            break;
+        }
+        if ((p = strchr(p, '\n')) == NULL)
+            return -1;
+    }
+    return isdigit((unsigned char)*(p += strspn(p, " "))) ? strtoll(p, NULL, 10) : -1;
+}
+
+/*
+ * cgbase - Open the delegated cgroup directory and enable the
+ * controllers for its children, once. Return -1 if unusable.
+ */
+static int cgbase(void)
+{
+    char path[MAXLINE + 16], line[MAXLINE];
+    char *dir = getvar("TSH_CGROUP");
+    FILE *fp;
+
+    if (cgbasefd != -2)
+        return cgbasefd;
+    cgbasefd = -1;
+    if (dir == NULL && (fp = fopen("/proc/self/cgroup", "r")) != NULL) {
+        while (fgets(line, sizeof(line), fp) != NULL)
+            if (!strncmp(line, "0::", 3)) {
+                line[strcspn(line, "\n")] = '\0';
+                snprintf(path, sizeof(path), "/sys/fs/cgroup%s", line + 3);
+                dir = path;
+            }
+        fclose(fp);
+    }
+    if (dir == NULL || (cgbasefd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+        return cgbasefd = -1;
+    if (faccessat(cgbasefd, "cgroup.subtree_control", W_OK, 0) < 0) {
+        close(cgbasefd);
+        return cgbasefd = -1;
+    }
+    /* one at a time, so a missing controller doesn't stop the others */
+    cgwrite(cgbasefd, "cgroup.subtree_control", "+memory");
+    cgwrite(cgbasefd, "cgroup.subtree_control", "+cpu");
+    cgwrite(cgbasefd, "cgroup.subtree_control", "+pids");
+    return cgbasefd;
+}
+
+/*
+ * limitcgroup - Make a cgroup with the limits in l, for a job about
+ * to be forked. Return its directory, with its name in name, or -1 if
+ * the limits can't be set that way.
+ */
+int limitcgroup(struct limit_t *l, char *name)
+{
+    char val[64];
+    int dfd;
+
+    if (cgbase() < 0)
+        goto fallback;
+    snprintf(name, 32, "tsh%d.%d", (int)getpid(), ++cgseq);
+    if (mkdirat(cgbasefd, name, 0755) < 0)
+        goto fallback;
+    if ((dfd = openat(cgbasefd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        unlinkat(cgbasefd, name, AT_REMOVEDIR);
+        goto fallback;
+    }
+    snprintf(val, sizeof(val), "%lld", l->mem);
+    if (l->mem > 0 && cgwrite(dfd, "memory.max", val) < 0)
+        goto error;
+    if (l->mem > 0)
+        cgwrite(dfd, "memory.swap.max", "0"); /* else it just swaps */
+    snprintf(val, sizeof(val), "%lld 100000", l->cpu);
+    if (l->cpu > 0 && cgwrite(dfd, "cpu.max", val) < 0)
+        goto error;
+    snprintf(val, sizeof(val), "%lld", l->pids);
+    if (l->pids > 0 && cgwrite(dfd, "pids.max", val) < 0)
+        goto error;
+    return dfd;
+
+ error:
+    close(dfd);
+    unlinkat(cgbasefd, name, AT_REMOVEDIR);
+ fallback:
+    if (verbose)
+        printf("limit: no cgroup, using setrlimit\n");
+    if (l->cpu > 0)
+        printf("limit: no cgroup, --cpu ignored\n");
+    return -1;
+}
+
+/* limitchild - In a limited job's child: join cgroup cgfd, or else
+   set rlimits */
+void limitchild(struct limit_t *l, int cgfd)
+{
+    struct rlimit rl;
+
+    if (cgfd >= 0 && cgwrite(cgfd, "cgroup.procs", "0") == 0)
+        return;
+    if (l->mem > 0) {
+        rl.rlim_cur = rl.rlim_max = l->mem;
+        setrlimit(RLIMIT_AS, &rl);
+    }
+    if (l->pids > 0) {
+        rl.rlim_cur = rl.rlim_max = l->pids;
+        setrlimit(RLIMIT_NPROC, &rl);
+    }
+}
+
+/* limitjob - Mark the job just added for pid as limited, by cgroup
+   cgfd (named name) if that is not -1 */
+void limitjob(pid_t pid, int cgfd, char *name)
+{
+    struct job_t *job = getjobpid(jobs, pid);
+
+    if (job == NULL) {
+        if (cgfd >= 0) {
+            close(cgfd);
+            unlinkat(cgbasefd, name, AT_REMOVEDIR);
+        }
+        return;
+    }
+    job->limited = 1;
+    job->cgfd = cgfd;
+    if (cgfd >= 0)
+        strcpy(job->cgname, name);
+}
+
+/*
+ * limitreap - For a limited job that has been reaped, its record
+ * holding wait4's figures: read the cgroup's figures over them,
+ * report them and remove the cgroup. The cgroup stays if the job
+ * left processes behind. Called from finishjobs.
+ */
+void limitreap(struct job_t *job)
+{
+    long long n;
+
+    job->ooms = 0;
+    if (job->cgfd >= 0) {
+        if ((n = cgread(job->cgfd, "memory.peak", NULL)) >= 0)
+            job->mempeak = n;
+        if ((n = cgread(job->cgfd, "cpu.stat", "usage_usec")) >= 0)
+            job->cpuusec = n;
+        if ((n = cgread(job->cgfd, "memory.events", "oom_kill")) >= 0)
+            job->ooms = n;
+        close(job->cgfd);
+        unlinkat(cgbasefd, job->cgname, AT_REMOVEDIR);
+        job->cgfd = -1;
+    }
+    printf("Job [%d] (%d) peak memory %.1fM, cpu %.2fs%s\n", job->jid, job->pid,
+           job->mempeak / 1048576.0, job->cpuusec / 1e6,
+           job->ooms > 0 ? ", out of memory" : "");
+}
+/*****************************
+ * end resource limit routines
+ *****************************/
+
+
+/*******************
+ * Pipeline routines
+ *******************/
+
+/*
+ * The external stages of a pipeline are forked into one process
+ * group, the job. Builtins that only print (stagebuiltin) don't need
+ * a process: they run on one of POOLSIZE threads, started on first
+ * use. A stage thread takes statelock, which the main thread lets go
+ * of only while it sleeps in waitevents, with the signal handlers
+ * held off (see poolwait). It runs the builtin through stagecmd,
+ * which returns the status rather than setting last_status, with the
+ * output going to a memory stream, then lets go and copies that to
+ * the stage's pipe. Builtins don't read their input, so that end is
+ * closed at once. Finished stages come back through pooldone in the
+ * event loop, and a job is over once its processes and its stage
+ * threads all are. With TSH_POOL=0 every stage is forked, as before
+ * the pool (tshbench's pipe test compares the two).
+ */
+
+/* stagebuiltin - Can this pipeline stage run as a thread? */
+int stagebuiltin(char **argv)
+{
+    static char *names[] = {
+        "jobs", "history", "joblog", "test", "[", "true", "false", ":", NULL
+    };
+    char *pool = getvar("TSH_POOL");
+    int i;
+
+    if (pool != NULL && !strcmp(pool, "0"))
+        return 0;
+    if (!strcmp(argv[0], "export"))
+        return argv[1] == NULL; /* a listing, not a change */
+    for (i = 0; names[i] != NULL; i++)
+        if (!strcmp(argv[0], names[i]))
+            return 1;
+    return 0;
+}
+
+/* stagecmd - Run builtin stage argv and return its status, leaving
+   last_status to the main thread */
+static int stagecmd(char **argv)
+{
+    if (!strcmp(argv[0], "jobs"))
+        listjobs(jobs);
+    else if (!strcmp(argv[0], "history"))
+        return do_history(argv);
+    else if (!strcmp(argv[0], "joblog"))
+        return do_joblog(argv);
+    else if (!strcmp(argv[0], "export"))
+        do_export(argv);
+    else if (!strcmp(argv[0], "test") || !strcmp(argv[0], "["))
+        return do_test(argv);
+    return !strcmp(argv[0], "false");
+}
+
+/* stageworker - A pool thread: run queued builtin stages */
+static void *stageworker(void *arg)
+{
+    struct stage_t *st;
+    struct iovec iov;
+    char *buf;
+    size_t len;
+
+    while (1) {
+        pthread_mutex_lock(&poollock);
+        while (poolq == NULL)
+            pthread_cond_wait(&poolcond, &poollock);
+        st = poolq;
+        poolq = st->next;
+        pthread_mutex_unlock(&poollock);
+
+        pthread_mutex_lock(&statelock);
+        buf = NULL;
+        len = 0;
+        st->status = 1;
+        if ((tout = open_memstream(&buf, &len)) != NULL) {
+            tjob = st->job;
+            st->status = stagecmd(st->argv);
+            fclose(tout);
+            tout = NULL;
+        }
+        pthread_mutex_unlock(&statelock);
+
+        /* a reader that quit early gets no more: EPIPE, as SIGPIPE
+           is blocked here */
+        iov.iov_base = buf;
+        iov.iov_len = len;
+        while (iov.iov_len > 0 && (len = writev(st->out, &iov, 1)) != (size_t)-1) {
+            iov.iov_base = (char *)iov.iov_base + len;
+            iov.iov_len -= len;
+        }
+        free(buf);
+        close(st->out);
+        write(pooldone[1], &st, sizeof(st));
+    }
+    return arg;
+}
+
+/* startpool - Start the stage threads, with every signal blocked so
+   that the handlers run on the main thread */
+static void startpool(void)
+{
+    struct epoll_event ev;
+    sigset_t all, prev;
+    pthread_t tid;
+
+    initevents();
+    if (pipe2(pooldone, O_CLOEXEC | O_NONBLOCK) < 0)
+        unix_error("pipe error");
+    ev.events = EPOLLIN;
+    ev.data.u64 = EV_POOL;
+    if (epoll_ctl(evfd, EPOLL_CTL_ADD, pooldone[0], &ev) < 0)
+        unix_error("epoll_ctl error");
+    sigemptyset(&all);
+    sigaddset(&all, SIGCHLD);
+    sigaddset(&all, SIGINT);
+    sigaddset(&all, SIGTSTP);
+    if ((sigfd = signalfd(-1, &all, SFD_NONBLOCK | SFD_CLOEXEC)) < 0)
+        unix_error("signalfd error");
+    ev.data.u64 = EV_SIGNAL;
+    if (epoll_ctl(evfd, EPOLL_CTL_ADD, sigfd, &ev) < 0)
+        unix_error("epoll_ctl error");
+    pthread_mutex_lock(&statelock);
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &prev);
+    for (npool = 0; npool < POOLSIZE; npool++) {
+        if (pthread_create(&tid, NULL, stageworker, NULL) != 0)
+            unix_error("pthread_create error");
+        pthread_detach(tid);
+    }
+    pthread_sigmask(SIG_SETMASK, &prev, NULL);
+}
+
+/*
+ * startpipeline - Start the n stages of a pipeline: fork the external
+ * ones into one process group, and set aside the builtin ones for
+ * addstages; quotes[i] holds the argquote flags of stages[i]. Return
+ * the process group, which becomes the job's PID.
+ * capfd, if not -1, gets the output, as in evalline. Called with
+ * SIGCHLD blocked; there is at least one external stage.
+ */
+pid_t startpipeline(char ***stages, char **quotes, int n, char **envp, int capfd,
+                    struct limit_t *lim, int cgfd, struct pipeline_t *pp)
+{
+    struct stage_t *st;
+    pid_t pid, pgid = 0;
+    int i, fd[2], in = -1, out;
+
+    memset(pp, 0, sizeof(*pp));
+    for (i = 0; i < n; i++) {
+        if (i < n - 1) {
+            if (pipe2(fd, O_CLOEXEC) < 0)
+                unix_error("pipe error");
+            out = fd[1];
+        }
+        else
+            out = capfd >= 0 ? capfd : STDOUT_FILENO;
+
+        if (stagebuiltin(stages[i])) {
+            if (in >= 0)
+                close(in);
+            if ((st = calloc(1, sizeof(*st))) == NULL)
+                unix_error("startpipeline error");
+            st->argv = packwords(stages[i]);
+            st->out = i < n - 1 ? out : fcntl(out, F_DUPFD_CLOEXEC, 0);
+            st->last = (i == n - 1);
+            pp->threads[pp->nthreads++] = st;
+        }
+        else {
+            if ((pid = fork()) < 0)
+                unix_error("fork error");
+            if (pid == 0) {
+                initchild(pgid);
+                if (lim->on)
+                    limitchild(lim, cgfd);
+                if (in >= 0)
+                    dup2(in, STDIN_FILENO);
+                if (out != STDOUT_FILENO)
+                    dup2(out, STDOUT_FILENO);
+                if (capfd >= 0)
+                    dup2(capfd, STDERR_FILENO);
+                if (builtin_cmd(stages[i])) { // one that needs a process
+                    fflush(stdout);
+                    exit(last_status);
+                }
+                execwords(stages[i], quotes[i], envp);
+            }
+            if (pgid == 0)
+                pgid = pid;
+            setpgid(pid, pgid);
+            pp->procs[pp->nprocs++] = pid;
+            if (i == n - 1)
+                pp->tail = pid;
+            if (in >= 0)
+                close(in);
+            if (i < n - 1)
+                close(out);
+        }
+        in = i < n - 1 ? fd[0] : -1;
+    }
+    return pgid;
+}
+
+/*
+ * addstages - Make the job just added for pid the whole pipeline pp,
+ * and hand its builtin stages to the pool
+ */
+void addstages(pid_t pid, struct pipeline_t *pp)
+{
+    struct job_t *job = getjobpid(jobs, pid);
+    struct stage_t **tail;
+    int i;
+
+    if (job != NULL) {
+        memcpy(job->procs, pp->procs, sizeof(job->procs));
+        job->nprocs = pp->nprocs + pp->nthreads;
+        job->tail = pp->tail;
+    }
+    if (pp->nthreads == 0)
+        return;
+    if (npool == 0)
+        startpool();
+    pthread_mutex_lock(&poollock);
+    for (tail = &poolq; *tail != NULL; tail = &(*tail)->next)
+        ;
+    for (i = 0; i < pp->nthreads; i++) {
+        pp->threads[i]->job = pid;
+        *tail = pp->threads[i];
+        tail = &pp->threads[i]->next;
+    }
+    pthread_cond_broadcast(&poolcond);
+    pthread_mutex_unlock(&poollock);
+}
+
+/* stagedone - Account for the stage threads that have finished */
+void stagedone(void)
+{
+    struct stage_t *st;
+    struct job_t *job;
+    sigset_t mask, prev_mask;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &prev_mask);
+    while (read(pooldone[0], &st, sizeof(st)) == sizeof(st)) {
+        if ((job = getjobpid(jobs, st->job)) != NULL) {
+            if (st->last && job->state == FG)
+                last_status = st->status;
+            if (--job->nprocs == 0)
+                deletejob(jobs, job->pid);
+        }
+        free(st->argv);
+        free(st);
+    }
+    sigprocmask(SIG_SETMASK, &prev_mask, NULL);
+}
+/*************************
+ * end pipeline routines
+ *************************/
+
+
+/***********************
+ * Result cache routines
+ ***********************/
+
+/*
+ * "memo command ..." runs a foreground command or pipeline through a
+ * cache in $TSH_MEMODIR (default ~/.tsh_memo). The key is a 64-bit
+ * hash of the current directory, every word, the file each command
+ * runs (by inode, size and mtime), the values of the variables named
+ * in $TSH_MEMOENV, and every word that names a file: its contents up
+ * to MEMOREADMAX bytes, its inode, size and mtime beyond that. So
+ * "memo sort < in" and "memo md5sum in" are keyed on in. Input the
+ * command reads from anywhere else, standard input included, is not
+ * seen: only memo commands that depend on nothing else.
+ *
+ * On a miss the job's stdout and stderr come through two pipes, which
+ * the event loop copies out and records as chunks, in order. If the
+ * job exits with a status below 128 the recording is stored in a file
+ * named by the key; on a hit the shell writes it out again and sets
+ * $? without forking. The last stage's >, >> and 2> are the shell's
+ * own for a memo'd job, so a hit rewrites those files too; one
+ * with output redirected elsewhere, or started in the background,
+ * runs as if there were no memo, as do functions and builtins. A hit
+ * touches its entry, and after each store the least recently used
+ * entries go until the cache fits in $TSH_MEMOSIZE (default
+ * MEMOSIZE). A job that stops, leaves something writing to its pipes
+ * or prints more than half of that is shown but not kept.
+ */
+
+/* memodir - Open the cache directory, once. Return -1 if unusable. */
+static int memodir(void)
+{
+    char path[MAXLINE];
+    char *dir = getvar("TSH_MEMODIR");
+    char *home = getvar("HOME");
+
+    if (memodirfd != -2)
+        return memodirfd;
+    if (dir == NULL) {
+        snprintf(path, sizeof(path), "%s/.tsh_memo", home ? home : ".");
+        dir = path;
+    }
+    mkdir(dir, 0700);
+    return memodirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+/* memolimit - The size bound of the cache, in bytes */
+static long long memolimit(void)
+{
+    char *s = getvar("TSH_MEMOSIZE");
+    long long bytes;
+
+    if (s == NULL || parsesize(s, &bytes) < 0)
+        return MEMOSIZE;
+    return bytes;
+}
+
+/* memomix - Add len bytes at p to hash h, eight at a time */
+static uint64_t memomix(uint64_t h, const void *p, size_t len)
+{
+    const unsigned char *s = p;
+    uint64_t w;
+
+    for (; len >= 8; s += 8, len -= 8) {
+        memcpy(&w, s, 8);
+        h = (h ^ w) * 0x9e3779b97f4a7c15ULL;
+        h ^= h >> 29;
+    }
+    for (w = len; len > 0; len--)
+        w = (w << 8) | s[len - 1];
+    h = (h ^ w) * 0xbf58476d1ce4e5b9ULL;
+    return h ^ (h >> 31);
+}
+
+/* memofile - Add what path is to hash h, if it is a file or directory */
+static uint64_t memofile(uint64_t h, const char *path, int contents)
+{
+    static char buf[SPOOLCHUNK];
+    long long id[6];
+    struct stat st;
+    ssize_t n;
+    int fd;
+
+    if (stat(path, &st) < 0 || !(S_ISREG(st.st_mode) || S_ISDIR(st.st_mode)))
+        return h;
+    if (contents && S_ISREG(st.st_mode) && st.st_size <= MEMOREADMAX &&
+        (fd = open(path, O_RDONLY | O_CLOEXEC)) >= 0) {
+        while ((n = read(fd, buf, sizeof(buf))) > 0)
+            h = memomix(h, buf, n);
+        close(fd);
+        return memomix(h, &st.st_size, sizeof(st.st_size));
+    }
+    id[0] = st.st_dev;
+    id[1] = st.st_ino;
+    id[2] = st.st_size;
+    id[3] = st.st_mtim.tv_sec;
+    id[4] = st.st_mtim.tv_nsec;
+    id[5] = st.st_mode;
+    return memomix(h, id, sizeof(id));
+}
+
+/* memokey - Hash everything the result of the pipeline may depend on */
+static uint64_t memokey(char ***stages, char **quotes, int n, char **envp)
+{
+    char cwd[MAXLINE], *names, *name, *save;
+    uint64_t h = 0;
+    int i, j, k, len, out;
+
+    if (getcwd(cwd, sizeof(cwd)) != NULL)
+        h = memomix(h, cwd, strlen(cwd) + 1);
+    for (i = 0; i < n; i++) {
+        h = memomix(h, "|", 2);
+        for (j = out = 0; stages[i][j] != NULL; j++) {
+            h = memomix(h, stages[i][j], strlen(stages[i][j]) + 1);
+            k = quotes[i][j] ? 0 : redirop(stages[i][j]);
+            if (j == 0)
+                h = memofile(h, pathfind(stages[i][0]), 0);
+            else if (!out && (k == 0 || stages[i][j][0] == '<'))
+                h = memofile(h, stages[i][j] + k, 1);
+            /* an output operator on its own: the next word is not read */
+            out = k > 0 && k < 4 && stages[i][j][0] != '<' && stages[i][j][k] == '\0';
+        }
+    }
+    if ((names = getvar("TSH_MEMOENV")) == NULL || (names = strdup(names)) == NULL)
+        return h;
+    for (name = strtok_r(names, ": ", &save); name != NULL; name = strtok_r(NULL, ": ", &save)) {
+        len = strlen(name);
+        for (i = 0; envp[i] != NULL; i++)
+            if (!strncmp(envp[i], name, len) && envp[i][len] == '=')
+                break;
+        h = memomix(h, name, len + 1);
+        if (envp[i] != NULL)
+            h = memomix(h, envp[i] + len, strlen(envp[i] + len) + 1);
+    }
+    free(names);
+    return h;
+}
+
+/* memoscan - List the cache entries; return their total size */
+static long long memoscan(struct memoent_t **ents, int *n)
+{
+    struct dirent *de;
+    struct stat st;
+    long long total = 0;
+    int fd, max = 0;
+    DIR *dir;
+
+    *ents = NULL;
+    *n = 0;
+    if ((fd = dup(memodirfd)) < 0)
+        return 0;
+    if ((dir = fdopendir(fd)) == NULL) {
+        close(fd);
+        return 0;
+    }
+    rewinddir(dir);
+    while ((de = readdir(dir)) != NULL) {
+        /* just the entries, not the ones still being written */
+        if (strlen(de->d_name) != 16 || fstatat(memodirfd, de->d_name, &st, 0) < 0)
+            continue;
+        if (*n == max) {
+            max = max ? max * 2 : 64;
+            if ((*ents = realloc(*ents, max * sizeof(**ents))) == NULL)
+                unix_error("memoscan error");
+        }
+        strcpy((*ents)[*n].name, de->d_name);
+        (*ents)[*n].size = st.st_size;
+        (*ents)[(*n)++].used = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+        total += st.st_size;
+    }
+    closedir(dir);
+    return total;
+}
+
+/* cmpmemoent - qsort comparison: least recently used first */
+static int cmpmemoent(const void *a, const void *b)
+{
+    const struct memoent_t *x = a, *y = b;
+
+    return (x->used > y->used) - (x->used < y->used);
+}
+
+/* memocopy - Copy len bytes from entry fd to fd to */
+static int memocopy(int fd, int to, uint32_t len)
+{
+    static char buf[SPOOLCHUNK];
+    struct iovec iov;
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = read(fd, buf, len < sizeof(buf) ? len : sizeof(buf))) <= 0)
+            return -1;
+        iov.iov_base = buf;
+        iov.iov_len = n;
+        writeall(to, &iov, 1);
+        len -= n;
+    }
+    return 0;
+}
+
+/* memoclose - Let go of a finished recording */
+static void memoclose(struct memo_t *m)
+{
+    int i;
+
+    for (i = 1; i <= 2; i++)
+        if (m->to[i] != i)
+            close(m->to[i]);
+    free(m->rec);
+    m->rec = NULL;
+    m->len = m->max = 0;
+}
+
+/*
+ * memostart - For a memo'd foreground pipeline about to be started:
+ * take over the last stage's output redirections, then replay the
+ * result if it is cached and return 1. Otherwise return 0, with the
+ * shell's stdout and stderr pointing into the recording's pipes if
+ * it can be recorded, until memoforked.
+ */
+int memostart(char ***stages, char **quotes, int n, char **envp)
+{
+    struct memo_t *m;
+    char **last = stages[n - 1], *file, name[32];
+    struct memohdr_t hdr;
+    struct epoll_event ev;
+    int to[3] = { -1, STDOUT_FILENO, STDERR_FILENO };
+    unsigned char c;
+    int i, j, k, t, fd, merged = 0, out[2], err[2];
+    uint32_t len;
+    uint64_t key;
+
+    /* a free slot (the others are jobs that stopped or left something
+       behind still writing); and output redirections are only
+       followed in the last stage */
+    for (m = memos; m < memos + MAXMEMOS && (m->nopen > 0 || m->pid != 0); m++)
+        ;
+    if (m == memos + MAXMEMOS || memodir() < 0)
+        goto skip;
+    for (i = 0; i < n; i++)
+        for (j = 0; stages[i][j] != NULL; j++) {
+            if ((k = quotes[i][j] ? 0 : redirop(stages[i][j])) == 4)
+                merged = 1;
+            else if (k > 0 && stages[i][j][0] != '<' && (i < n - 1 || merged))
+                goto skip;
+        }
+    key = memokey(stages, quotes, n, envp);
+
+    for (i = j = 0; last[i] != NULL; i += k) {
+        if (!quotes[n - 1][i] && (k = redirop(last[i])) > 0 && k < 4 && last[i][0] != '<') {
+            if ((file = last[i][k] ? last[i] + k : last[i + 1]) == NULL) {
+                printf("%s: missing file name\n", last[i]);
+                break;
+            }
+            t = last[i][0] == '2' ? 2 : 1;
+            if (to[t] != t)
+                close(to[t]);
+            if ((to[t] = open(file, O_WRONLY | O_CREAT | O_CLOEXEC |
+                              (k > 1 && last[i][k - 2] == '>' ? O_APPEND : O_TRUNC),
+                              0666)) < 0) {
+                printf("%s: %s\n", file, strerror(errno));
+                break;
+            }
+            k = last[i][k] ? 1 : 2;
+        }
+        else {
+            quotes[n - 1][j] = quotes[n - 1][i];
+            last[j++] = last[i];
+            k = 1;
+        }
+    }
+    m->to[1] = to[1];
+    m->to[2] = to[2];
+    if (last[i] != NULL) {
+        memoclose(m);
+        last_status = 1;
+        return 1;
+    }
+    last[j] = NULL;
+
+    sprintf(name, "%016llx", (unsigned long long)key);
+    if ((fd = openat(memodirfd, name, O_RDONLY | O_CLOEXEC)) >= 0) {
+        if (read(fd, &hdr, sizeof(hdr)) == sizeof(hdr) && !memcmp(hdr.magic, MEMOMAGIC, 8)) {
+            /* a hit: copy out the chunks, stream byte and length first */
+            fflush(stdout);
+            while (read(fd, &c, 1) == 1 && (c == 1 || c == 2) &&
+                   read(fd, &len, sizeof(len)) == sizeof(len) &&
+                   memocopy(fd, to[c], len) == 0)
+                ;
+            close(fd);
+            utimensat(memodirfd, name, NULL, 0);
+            memohits++;
+            memosaved += hdr.usecs;
+            memoclose(m);
+            last_status = hdr.status;
+            return 1;
+        }
+        close(fd);
+    }
+
+    /* a miss: the job writes into pipes that the event loop drains */
+    if (pipe2(out, O_CLOEXEC) < 0 || pipe2(err, O_CLOEXEC) < 0)
+        unix_error("pipe error");
+    initevents();
+    m->key = key;
+    m->fd[1] = out[0];
+    m->fd[2] = err[0];
+    for (i = 1; i <= 2; i++) {
+        fcntl(m->fd[i], F_SETFL, O_NONBLOCK);
+        ev.events = EPOLLIN;
+        ev.data.u64 = EV_MEMO + 2 * (m - memos) + i - 1;
+        if (epoll_ctl(evfd, EPOLL_CTL_ADD, m->fd[i], &ev) < 0)
+            unix_error("epoll_ctl error");
+    }
+    m->nopen = 2;
+    m->pid = -1;
+    m->keep = 1;
+    m->last = 0;
+    m->start = nowns();
+    memomisses++;
+    fflush(stdout);
+    m->saved[1] = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+    m->saved[2] = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 0);
+    dup2(out[1], STDOUT_FILENO);
+    dup2(err[1], STDERR_FILENO);
+    close(out[1]);
+    close(err[1]);
+    return 0;
+
+skip:
+    memoskips++;
+    return 0;
+}
+
+/* memoforked - The recorded job has started: take our stdout and stderr back */
+void memoforked(pid_t pid)
+{
+    struct memo_t *m;
+    int i;
+
+    for (m = memos; m < memos + MAXMEMOS; m++)
+        if (m->pid == -1) {
+            for (i = 1; i <= 2; i++) {
+                dup2(m->saved[i], i);
+                close(m->saved[i]);
+            }
+            m->pid = pid;
+        }
+}
+
+/* memorecord - Add n bytes the job wrote to stream to the recording */
+static void memorecord(struct memo_t *m, int stream, const char *buf, size_t n)
+{
+    uint32_t len;
+
+    if (m->len + n + 5 > (size_t)memolimit() / 2) {
+        m->keep = 0;
+        return;
+    }
+    if (m->len + n + 5 > m->max) {
+        m->max = (m->len + n + 5) * 2;
+        if ((m->rec = realloc(m->rec, m->max)) == NULL)
+            unix_error("memorecord error");
+    }
+    /* one chunk for consecutive writes to the same stream */
+    if (m->len > 0 && m->rec[m->last] == stream) {
+        memcpy(&len, m->rec + m->last + 1, sizeof(len));
+        len += n;
+        memcpy(m->rec + m->last + 1, &len, sizeof(len));
+    }
+    else {
+        m->last = m->len;
+        m->rec[m->len] = stream;
+        len = n;
+        memcpy(m->rec + m->len + 1, &len, sizeof(len));
+        m->len += 5;
+    }
+    memcpy(m->rec + m->len, buf, n);
+    m->len += n;
+}
+
+/*
+ * memodrain - Copy out and record everything available from a job's
+ * stdout (stream 1) or stderr (2)
+ */
+void memodrain(struct memo_t *m, int stream)
+{
+    static char buf[SPOOLCHUNK];
+    struct iovec iov;
+    ssize_t n;
+
+    fflush(stdout);
+    while ((n = read(m->fd[stream], buf, sizeof(buf))) > 0) {
+        iov.iov_base = buf;
+        iov.iov_len = n;
+        writeall(m->to[stream], &iov, 1);
+        if (m->keep)
+            memorecord(m, stream, buf, n);
+    }
+    if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+        epoll_ctl(evfd, EPOLL_CTL_DEL, m->fd[stream], NULL);
+        close(m->fd[stream]);
+        m->fd[stream] = -1;
+        if (--m->nopen == 0 && m->pid == 0)
+            memoclose(m);
+    }
+}
+
+/* memoevict - Remove the least recently used entries over the bound */
+static void memoevict(long long limit)
+{
+    struct memoent_t *ents;
+    long long total;
+    int i, n;
+
+    total = memoscan(&ents, &n);
+    qsort(ents, n, sizeof(*ents), cmpmemoent);
+    for (i = 0; i < n && total > limit; i++) {
+        if (unlinkat(memodirfd, ents[i].name, 0) == 0)
+            total -= ents[i].size;
+    }
+    free(ents);
+}
+
+/* memostore - Write the recording to its cache entry */
+static void memostore(struct memo_t *m)
+{
+    char name[32], tmp[48];
+    struct memohdr_t hdr;
+    struct iovec iov[2];
+    int fd;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, MEMOMAGIC, 8);
+    hdr.status = last_status;
+    hdr.usecs = (nowns() - m->start) / 1000;
+    sprintf(name, "%016llx", (unsigned long long)m->key);
+    sprintf(tmp, "%s.%d", name, getpid());
+    if ((fd = openat(memodirfd, tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) < 0)
+        return;
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len = sizeof(hdr);
+    iov[1].iov_base = m->rec;
+    iov[1].iov_len = m->len;
+    /* written in full under another name, so a reader never sees half */
+    if (writev(fd, iov, 2) != (ssize_t)(sizeof(hdr) + m->len) ||
+        close(fd) < 0 || renameat(memodirfd, tmp, memodirfd, name) < 0) {
+        unlinkat(memodirfd, tmp, 0);
+        return;
+    }
+    memoevict(memolimit());
+}
+
+/*
+ * memodone - The recorded job is no longer in the foreground: store
+ * the recording if the job finished, with its output all read
+ */
+void memodone(pid_t pid)
+{
+    struct memo_t *m;
+    int i;
+
+    for (m = memos; m < memos + MAXMEMOS && m->pid != pid; m++)
+        ;
+    if (m == memos + MAXMEMOS)
+        return;
+    if (getjobpid(jobs, pid) != NULL)   /* stopped */
+        m->keep = 0;
+    else
+        for (i = 1; i <= 2; i++)
+            if (m->fd[i] >= 0)
+                memodrain(m, i);
+    m->pid = 0;
+    if (m->nopen > 0)   /* still running, or left something behind */
+        return;
+    if (m->keep && last_status < 128)
+        memostore(m);
+    memoclose(m);
+}
+
+/*
+ * do_memo - Execute the builtin memo command without a command:
+ *     memo [-s|-c]
+ */
+void do_memo(char **argv)
+{
+    struct memoent_t *ents;
+    long long total;
+    int n;
+
+    if (argv[1] != NULL && strcmp(argv[1], "-s") && strcmp(argv[1], "-c")) {
+        printf("usage: memo [-s|-c] | memo command ...\n");
+        last_status = 1;
+        return;
+    }
+    if (memodir() < 0) {
+        printf("memo: no cache directory\n");
+        last_status = 1;
+        return;
+    }
+    if (argv[1] != NULL && !strcmp(argv[1], "-c")) {
+        memoevict(0);
+        return;
+    }
+    total = memoscan(&ents, &n);
+    free(ents);
+    printf("memo: %ld hits, %ld misses, %ld not cached, %.2fs saved\n",
+           memohits, memomisses, memoskips, memosaved / 1e6);
+    printf("memo: %d entries, %lld of %lld bytes\n", n, total, memolimit());
+}
+/***************************
+ * end result cache routines
+ ***************************/
+
+
+/*****************************
+ * Command history routines
+ *****************************/
+
+/*
+ * History is kept in $TSH_HISTFILE (default ~/.tsh_history), shared by all
+ * sessions. Each record is one write(2) to an O_APPEND descriptor, so
+ * records from concurrent shells never interleave:
+ *
+ *     uint32 len | uint32 check | len bytes of command
+ *
+ * check is a hash of len and the command, which lets a reader skip a
+ * record torn by a crash. Readers map the file and keep the offset of
+ * every record plus a trigram index: for each of TRIBUCKETS hashed
+ * trigrams, the ascending list of records that contain one. The index
+ * is checkpointed to TSH_HISTFILE.idx at exit (once the unindexed tail
+ * is worth it), so the next session maps it and only indexes records
+ * appended after histend. The lists stay in the map until a record is
+ * added to them. Nothing is read until history is first used.
+ */
+
+/* histfile - Return the history file name followed by suffix */
+char *histfile(const char *suffix)
+{
+    static char path[MAXLINE];
+    char *hf = getvar("TSH_HISTFILE");
+    char *home = getvar("HOME");
+
+    if (hf != NULL)
+        snprintf(path, sizeof(path), "%s%s", hf, suffix);
+    else
+        snprintf(path, sizeof(path), "%s/.tsh_history%s", home ? home : ".", suffix);
+    return path;
+}
+
+/* histcheck - The check word of a record */
+static uint32_t histcheck(const char *p, uint32_t len)
+{
+    uint32_t h = 2166136261u ^ len;
+
+    while (len-- > 0)
+        h = (h ^ (unsigned char)*p++) * 16777619u;
+    return h;
+}
+
+/* histadd - Append a command line to the history file */
+void histadd(const char *line)
+{
+    char rec[8 + MAXLINE];
+    uint32_t len = strcspn(line, "\n");
+    uint32_t check = histcheck(line, len);
+
+    if (line[strspn(line, " \t\n")] == '\0')
+        return;
+    if (histfd < 0 &&
+        (histfd = open(histfile(""), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600)) < 0)
+        return;
+    memcpy(rec, &len, 4);
+    memcpy(rec + 4, &check, 4);
+    memcpy(rec + 8, line, len);
+    write(histfd, rec, 8 + len);
+}
+
+/* tribucket - Index bucket of the trigram at p */
+static uint32_t tribucket(const char *p)
+{
+    uint32_t t = (unsigned char)p[0] << 16 | (unsigned char)p[1] << 8 | (unsigned char)p[2];
+
+    return (t * 2654435761u) >> 16 & (TRIBUCKETS - 1);
+}
+
+/*
+ * growlist - Make room for one more element in a list of n elements
+ * of size bytes, allocated for *max of them, or still in histidx if
+ * *max is 0
+ */
+static void *growlist(void *list, uint32_t n, uint32_t *max, size_t size)
+{
+    void *grown;
+
+    if (n < *max)
+        return list;
+    if (*max > 0)
+        grown = realloc(list, 2 * n * size);
+    else if ((grown = malloc((n ? 2 * n : 4) * size)) != NULL && n > 0)
+        memcpy(grown, list, n * size);
+    if (grown == NULL)
+        unix_error("history index error");
+    *max = n ? 2 * n : 4;
+    return grown;
+}
+
+/* postid - Add record id to a posting list, once */
+static void postid(struct posting_t *pt, uint32_t id)
+{
+    if (pt->n > 0 && pt->ids[pt->n - 1] == id)
+        return;
+    pt->ids = growlist(pt->ids, pt->n, &pt->max, sizeof(uint32_t));
+    pt->ids[pt->n++] = id;
+}
+
+/*
+ * histloadindex - Map the checkpointed index, if it is usable. The
+ * record offsets and posting lists are used where they lie in the map.
+ */
+static void histloadindex(void)
+{
+    uint32_t hdr[6], count, i;
+    uint64_t end, off;
+    struct stat st;
+    int fd;
+
+    if ((tris = calloc(TRIBUCKETS, sizeof(*tris))) == NULL)
+        unix_error("history index error");
+    if ((fd = open(histfile(".idx"), O_RDONLY | O_CLOEXEC)) < 0)
+        return;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(hdr) ||
+        (histidx = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        histidx = NULL;
+        close(fd);
+        return;
+    }
+    close(fd);
+    histidxsize = st.st_size;
+
+    /* magic, TRIBUCKETS, nhist, 0, histend (2 words) */
+    memcpy(hdr, histidx, sizeof(hdr));
+    if (hdr[0] != HISTMAGIC || hdr[1] != TRIBUCKETS ||
+        (memcpy(&end, &hdr[4], 8), end > histmapsize))
+        goto bad;
+    nhist = hdr[2];
+    off = sizeof(hdr) + (uint64_t)nhist * sizeof(uint64_t);
+    if (off > histidxsize)
+        goto bad;
+    histrecs = (uint64_t *)(histidx + sizeof(hdr));
+    if (nhist > 0) {    /* is this still the file we indexed? */
+        uint32_t len, check;
+        uint64_t last = histrecs[nhist - 1];
+        if (last + 8 > end || (memcpy(&len, histmap + last, 4), last + 8 + len > end) ||
+            (memcpy(&check, histmap + last + 4, 4), histcheck(histmap + last + 8, len) != check))
+            goto bad;
+    }
+    for (i = 0; i < TRIBUCKETS; i++) {
+        if (off + 4 > histidxsize)
+            goto bad;
+        memcpy(&count, histidx + off, 4);
+        off += 4;
+        if ((uint64_t)count * sizeof(uint32_t) > histidxsize - off)
+            goto bad;
+        tris[i].n = count;
+        tris[i].ids = count ? (uint32_t *)(histidx + off) : NULL;
+        off += count * sizeof(uint32_t);
+    }
+    histend = end;
+    histsaved = nhist;
+    return;
+
+ bad:   /* start over from the beginning of the history file */
+    munmap(histidx, histidxsize);
+    histidx = NULL;
+    memset(tris, 0, TRIBUCKETS * sizeof(*tris));
+    histrecs = NULL;
+    nhist = 0;
+}
+
+/*
+ * histrefresh - Map any records appended since the last call, by any
+ * session, and index them. Return -1 if there is no history.
+ */
+int histrefresh(void)
+{
+    struct stat st;
+    uint32_t len, check;
+    uint64_t off;
+    const char *p;
+    int fd;
+
+    if ((fd = open(histfile(""), O_RDONLY | O_CLOEXEC)) < 0)
+        return -1;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        close(fd);
+        return -1;
+    }
+    if ((size_t)st.st_size != histmapsize) {
+        if (histmap != NULL)
+            munmap(histmap, histmapsize);
+        histmap = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (histmap == MAP_FAILED) {
+            histmap = NULL;
+            histmapsize = 0;
+            close(fd);
+            return -1;
+        }
+        histmapsize = st.st_size;
+    }
+    close(fd);
+    if (tris == NULL)
+        histloadindex();
+
+    for (off = histend; off + 8 <= histmapsize; ) {
+        memcpy(&len, histmap + off, 4);
+        memcpy(&check, histmap + off + 4, 4);
+        p = histmap + off + 8;
+        if (len > MAXLINE || off + 8 + len > histmapsize || histcheck(p, len) != check) {
+            off++;      /* torn record: resynchronize */
+            continue;
+        }
+        histrecs = growlist(histrecs, nhist, &maxhist, sizeof(uint64_t));
+        histrecs[nhist] = off;
+        for (; len >= 3; p++, len--)
+            postid(&tris[tribucket(p)], nhist);
+        nhist++;
+        off = p + len - histmap;
+    }
+    histend = off;
+    return 0;
+}
+
+/* histget - Return record i and its length */
+const char *histget(uint32_t i, int *len)
+{
+    uint32_t n;
+
+    memcpy(&n, histmap + histrecs[i], 4);
+    *len = n;
+    return histmap + histrecs[i] + 8;
+}
+
+/*
+ * histsave - Checkpoint the index if this session indexed anything
+ * new. Written to a temporary file and renamed into place.
+ */
+void histsave(void)
+{
+    uint32_t hdr[6] = { HISTMAGIC, TRIBUCKETS, 0, 0, 0, 0 };
+    char tmp[MAXLINE];
+    FILE *fp;
+    uint32_t i;
+
+    /* Rewriting a big index for a few records is not worth it; the
+       next session can index a short tail itself */
+    if (getpid() != histowner || tris == NULL || nhist == histsaved ||
+        nhist - histsaved < nhist / 64)
+        return;
+    snprintf(tmp, sizeof(tmp), "%s.%d", histfile(".idx"), (int)getpid());
+    if ((fp = fopen(tmp, "w")) == NULL)
+        return;
+    hdr[2] = nhist;
+    memcpy(&hdr[4], &histend, 8);
+    fwrite(hdr, sizeof(hdr), 1, fp);
+    fwrite(histrecs, sizeof(uint64_t), nhist, fp);
+    for (i = 0; i < TRIBUCKETS; i++) {
+        fwrite(&tris[i].n, 4, 1, fp);
+        fwrite(tris[i].ids, sizeof(uint32_t), tris[i].n, fp);
+    }
+    if (fclose(fp) == 0)
+        rename(tmp, histfile(".idx"));
+    else
+        unlink(tmp);
+}
+
+/*
+ * histsearch - Call found(i) for each record containing pat, oldest
+ * first. Only records listed under pat's rarest trigram are checked.
+ */
+static void histsearch(const char *pat, void (*found)(uint32_t))
+{
+    struct posting_t all = { NULL, 0, 0 }, *best = &all;
+    int plen = strlen(pat), len;
+    const char *rec;
+    uint32_t i;
+
+    if (plen >= 3) {
+        best = &tris[tribucket(pat)];
+        for (i = 1; i + 3 <= (uint32_t)plen; i++)
+            if (tris[tribucket(pat + i)].n < best->n)
+                best = &tris[tribucket(pat + i)];
+    }
+    for (i = 0; i < (best == &all ? nhist : best->n); i++) {
+        rec = histget(best == &all ? i : best->ids[i], &len);
+        if (memmem(rec, len, pat, plen) != NULL)
+            found(best == &all ? i : best->ids[i]);
+    }
+}
+
+/* histprint - Print history record i */
+static void histprint(uint32_t i)
+{
+    int len;
+    const char *rec = histget(i, &len);
+
+    fprintf(OUT, "%6u  %.*s\n", i + 1, len, rec);
+}
+
+/*
+ * do_history - Execute the builtin history command, and return its
+ * status:
+ *     history [N]          the last N commands (all by default)
+ *     history -s TEXT      the commands containing TEXT
+ */
+int do_history(char **argv)
+{
+    uint32_t i, n;
+
+    if (histrefresh() < 0)
+        return 0;
+    if (argv[1] != NULL && !strcmp(argv[1], "-s")) {
+        if (argv[2] == NULL) {
+            fprintf(OUT, "usage: history [N] | history -s TEXT\n");
+            return 1;
+        }
+        histsearch(argv[2], histprint);
+        return 0;
+    }
+    n = argv[1] != NULL ? (uint32_t)atol(argv[1]) : nhist;
+    for (i = n < nhist ? nhist - n : 0; i < nhist; i++)
+        histprint(i);
+    return 0;
+}
+/********************************
+ * end command history routines
+ ********************************/
+
+
+/*****************************************
+ * Line editor and completion routines
+ *****************************************/
+
+/*
+ * pathfind - Return the file that running name means: name itself if
+ * it contains a '/', else the first executable of that name on PATH.
+ * Falls back to name, so execve reports the failure.
+ */
+char *pathfind(char *name)
+{
+    static char path[MAXLINE];
+    char *dirs = getvar("PATH");
+    char *p, *end;
+
+    if (name == NULL || strchr(name, '/') != NULL || dirs == NULL)
+        return name;
+    for (p = dirs; ; p = end + 1) {
+        end = strchrnul(p, ':');
+        snprintf(path, sizeof(path), "%.*s%s%s", (int)(end - p), p,
+                 end > p ? "/" : "", name);
+        if (access(path, X_OK) == 0)
+            return path;
+        if (*end == '\0')
+            return name;
+    }
+}
+
+/*
+ * The PATH index is a sorted array of executable names. It is built
+ * by a background thread when the line editor is first used, so the
+ * first Tab rarely waits for it. The thread then sleeps on an
+ * inotify descriptor watching every PATH directory and patches the
+ * array as programs come and go. Completing a command is a binary
+ * search. If PATH changes, a new thread is started and the old one
+ * notices exegen has moved on and exits.
+ */
+
+/* isexec - Is dir/name an executable regular file? */
+static int isexec(const char *dir, const char *name)
+{
+    char path[MAXLINE];
+    struct stat st;
+
+    snprintf(path, sizeof(path), "%s/%s", *dir ? dir : ".", name);
+    return stat(path, &st) == 0 && S_ISREG(st.st_mode) && access(path, X_OK) == 0;
+}
+
+/* exefind - Index of the first name >= key; sets *found on a match */
+static int exefind(const char *key, int *found)
+{
+    int lo = 0, hi = nexe, mid, c;
+
+    *found = 0;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if ((c = strcmp(exenames[mid], key)) == 0) {
+            *found = 1;
+            return mid;
+        }
+        if (c < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* exeupdate - Add or remove a name in the index; exelock is held */
+static void exeupdate(const char *name, int add)
+{
+    int found, i = exefind(name, &found);
+
+    if (add && !found) {
+        if (nexe == maxexe) {
+            maxexe = maxexe ? 2 * maxexe : 1024;
+            if ((exenames = realloc(exenames, maxexe * sizeof(char *))) == NULL)
+                unix_error("exeupdate error");
+        }
+        memmove(exenames + i + 1, exenames + i, (nexe - i) * sizeof(char *));
+        exenames[i] = strdup(name);
+        nexe++;
+    }
+    else if (!add && found) {
+        free(exenames[i]);
+        memmove(exenames + i, exenames + i + 1, (nexe - i - 1) * sizeof(char *));
+        nexe--;
+    }
+}
+
+/* cmpname - qsort comparison for exenames */
+static int cmpname(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* exeindex - Body of the thread that builds and maintains the index */
+static void *exeindex(void *arg)
+{
+    char *path = arg, *dirs[MAXARGS], *p;
+    char evbuf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *ev;
+    struct pollfd pfd;
+    struct dirent *de;
+    sigset_t all;
+    char **names = NULL;
+    int gen, ndirs = 0, n = 0, max = 0, i, k, ifd, wds[MAXARGS];
+    ssize_t len;
+    DIR *dp;
+
+    /* Signals are for the main thread */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, NULL);
+
+    pthread_mutex_lock(&exelock);
+    gen = exegen;
+    pthread_mutex_unlock(&exelock);
+    ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+    for (p = path; ndirs < MAXARGS; p++) {
+        dirs[ndirs++] = p;
+        if (*(p = strchrnul(p, ':')) == '\0')
+            break;
+        *p = '\0';
+    }
+    for (i = 0; i < ndirs; i++) {
+        wds[i] = inotify_add_watch(ifd, *dirs[i] ? dirs[i] : ".",
+                                   IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+                                   IN_MOVED_TO | IN_ATTRIB | IN_CLOSE_WRITE);
+        if ((dp = opendir(*dirs[i] ? dirs[i] : ".")) == NULL)
+            continue;
+        while ((de = readdir(dp)) != NULL) {
+            if (de->d_name[0] == '.' || !isexec(dirs[i], de->d_name))
+                continue;
+            if (n == max && (names = realloc(names, (max = max ? 2*max : 1024) * sizeof(char *))) == NULL)
+                unix_error("exeindex error");
+            names[n++] = strdup(de->d_name);
+        }
+        closedir(dp);
+    }
+    qsort(names, n, sizeof(char *), cmpname);
+    for (i = 0, k = 0; i < n; i++) {
+        if (k > 0 && !strcmp(names[k-1], names[i]))
+            free(names[i]);
+        else
+            names[k++] = names[i];
+    }
+    n = k;      /* names[k..] are freed or moved */
+
+    pthread_mutex_lock(&exelock);
+    if (gen == exegen) {
+        for (i = 0; i < nexe; i++)
+            free(exenames[i]);
+        free(exenames);
+        exenames = names;
+        nexe = n;
+        maxexe = max;
+        names = NULL;
+    }
+    pthread_mutex_unlock(&exelock);
+
+    /* Follow changes until PATH does */
+    pfd.fd = ifd;
+    pfd.events = POLLIN;
+    while (ifd >= 0) {
+        poll(&pfd, 1, 1000);
+        pthread_mutex_lock(&exelock);
+        if (gen != exegen) {
+            pthread_mutex_unlock(&exelock);
+            break;
+        }
+        while ((len = read(ifd, evbuf, sizeof(evbuf))) > 0) {
+            for (p = evbuf; p < evbuf + len; p += sizeof(*ev) + ev->len) {
+                ev = (struct inotify_event *)p;
+                for (i = 0; i < ndirs && wds[i] != ev->wd; i++)
+                    ;
+                if (i == ndirs || ev->len == 0 || ev->name[0] == '.')
+                    continue;
+                if (isexec(dirs[i], ev->name))
+                    exeupdate(ev->name, 1);
+                else {
+                    /* gone here, but maybe still on PATH elsewhere */
+                    for (k = 0; k < ndirs && !isexec(dirs[k], ev->name); k++)
+                        ;
+                    if (k == ndirs)
+                        exeupdate(ev->name, 0);
+                }
+            }
+        }
+        pthread_mutex_unlock(&exelock);
+    }
+    if (ifd >= 0)
+        close(ifd);
+    if (names != NULL) {
+        for (i = 0; i < n; i++)
+            free(names[i]);
+        free(names);
+    }
+    free(path);
+    return NULL;
+}
+
+/*
+ * startexeindex - Start indexing PATH, unless the current PATH is
+ * already being indexed
+ */
+void startexeindex(void)
+{
+    char *path = getvar("PATH");
+    pthread_t tid;
+
+    if (path == NULL || (exepath != NULL && !strcmp(exepath, path)))
+        return;
+    free(exepath);
+    exepath = strdup(path);
+    pthread_mutex_lock(&exelock);
+    exegen++;
+    pthread_mutex_unlock(&exelock);
+    if (pthread_create(&tid, NULL, exeindex, strdup(path)) == 0)
+        pthread_detach(tid);
+}
+
+struct cands_t {            /* Completion candidates */
+    char **v;               /* the candidates */
+    int n;                  /* number of candidates */
+    int max;                /* allocated size of v */
+};
+
+/* addcand - Add a candidate (copied) */
+static void addcand(struct cands_t *c, const char *word, const char *suffix)
+{
+    if (c->n == c->max &&
+        (c->v = realloc(c->v, (c->max = c->max ? 2 * c->max : 64) * sizeof(char *))) == NULL)
+        unix_error("addcand error");
+    if ((c->v[c->n] = malloc(strlen(word) + strlen(suffix) + 1)) == NULL)
+        unix_error("addcand error");
+    strcat(strcpy(c->v[c->n++], word), suffix);
+}
+
+/* redraw - Show the prompt and the line being edited again */
+static void redraw(const char *buf, int len)
+{
+    char out[2*MAXLINE];
+    int n = snprintf(out, sizeof(out), "\r\033[K%s%.*s", shownprompt, len, buf);
+
+    write(STDOUT_FILENO, out, n < (int)sizeof(out) ? n : (int)sizeof(out) - 1);
+}
+
+/*
+ * complete - Complete the word before the end of buf: a job spec
+ * (%N), a command if it is the first word, else a file name
+ */
+static void complete(char *buf, int *len, int size)
+{
+    struct cands_t c = { NULL, 0, 0 };
+    char word[MAXLINE], dir[MAXLINE], pfx[MAXLINE], jid[16];
+    struct func_t *fn;
+    struct dirent *de;
+    struct stat st;
+    char *base;
+    int ws, wlen, first, i, k, lcp, found;
+    DIR *dp;
+
+    for (ws = *len; ws > 0 && buf[ws-1] != ' '; ws--)
+        ;
+    for (first = 1, i = 0; i < ws; i++)
+        if (buf[i] != ' ')
+            first = 0;
+    wlen = *len - ws;
+    memcpy(word, buf + ws, wlen);
+    word[wlen] = '\0';
+
+    if (word[0] == '%') {
+        for (i = 0; i < MAXJOBS; i++) {
+            sprintf(jid, "%%%d", jobs[i].jid);
+            if (jobs[i].pid != 0 && !strncmp(jid, word, wlen))
+                addcand(&c, jid, " ");
+        }
+    }
+    else if (first && strchr(word, '/') == NULL) {
+        for (i = 0; builtins[i] != NULL; i++)
+            if (!strncmp(builtins[i], word, wlen))
+                addcand(&c, builtins[i], " ");
+        for (fn = funcs; fn != NULL; fn = fn->next)
+            if (!strncmp(fn->name, word, wlen))
+                addcand(&c, fn->name, " ");
+        pthread_mutex_lock(&exelock);
+        for (i = exefind(word, &found); i < nexe && !strncmp(exenames[i], word, wlen); i++)
+            addcand(&c, exenames[i], " ");
+        pthread_mutex_unlock(&exelock);
+    }
+    else {
+        if ((base = strrchr(word, '/')) != NULL) {
+            base++;
+            snprintf(dir, sizeof(dir), "%.*s", (int)(base - word), word);
+        }
+        else {
+            base = word;
+            dir[0] = '\0';
+        }
+        snprintf(pfx, sizeof(pfx), "%s", base);
+        if ((dp = opendir(*dir ? dir : ".")) != NULL) {
+            while ((de = readdir(dp)) != NULL) {
+                if (strncmp(de->d_name, pfx, strlen(pfx)) ||
+                    (de->d_name[0] == '.' && pfx[0] != '.') ||
+                    !strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+                    continue;
+                snprintf(word + (base - word), sizeof(word) - (base - word), "%s", de->d_name);
+                addcand(&c, word, stat(word, &st) == 0 && S_ISDIR(st.st_mode) ? "/" : " ");
+            }
+            closedir(dp);
+        }
+    }
+
+    if (c.n == 0) {
+        write(STDOUT_FILENO, "\a", 1);
+        return;
+    }
+    qsort(c.v, c.n, sizeof(char *), cmpname);
+    for (i = 1, k = 1; i < c.n; i++) {      /* a builtin may also be on PATH */
+        if (!strcmp(c.v[k-1], c.v[i]))
+            free(c.v[i]);
+        else
+            c.v[k++] = c.v[i];
+    }
+    c.n = k;
+    /* Insert what all candidates share, suffix included if just one */
+    lcp = strlen(c.v[0]) - (c.n > 1);
+    for (i = 1; i < c.n; i++)
+        for (k = 0; k < lcp; k++)
+            if (c.v[i][k] != c.v[0][k]) {
+                lcp = k;
+                break;
+            }
+    if (lcp > wlen && ws + lcp < size - 2) {
+        memcpy(buf + ws, c.v[0], lcp);
+        *len = ws + lcp;
+    }
+    else if (c.n > 1) {
+        /* Nothing to add: list the choices */
+        write(STDOUT_FILENO, "\n", 1);
+        for (i = 0; i < c.n && i < 100; i++)
+            printf("%.*s%s", (int)strcspn(c.v[i], " "), c.v[i], (i % 4 == 3) ? "\n" : "\t");
+        if (c.n > 100)
+            printf("... and %d more", c.n - 100);
+        printf("\n");
+        fflush(stdout);
+    }
+    redraw(buf, *len);
+    for (i = 0; i < c.n; i++)
+        free(c.v[i]);
+    free(c.v);
+}
+
+/* lastmatch - histsearch callback that keeps the newest match before limit */
+static uint32_t rsearchlimit, rsearchfound;
+static void lastmatch(uint32_t i)
+{
+    if (i < rsearchlimit)
+        rsearchfound = i + 1;
+}
+
+/*
+ * escbyte - The next byte of an escape sequence, or -1 if none comes
+ * soon: a terminal sends a whole sequence at once, a lone Esc key
+ * press is followed by nothing
+ */
+static int escbyte(void)
+{
+    struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+    unsigned char c;
+
+    if (poll(&pfd, 1, 50) <= 0 || read(STDIN_FILENO, &c, 1) != 1)
+        return -1;
+    return c;
+}
+
+/*
+ * skipescape - Swallow the rest of an escape sequence whose Esc has
+ * been read: CSI (Esc [ params final, as the arrow, Home and Delete
+ * keys send), SS3 (Esc O x) or Esc and one more byte (Alt-x)
+ */
+static void skipescape(void)
+{
+    int c = escbyte();
+
+    if (c == '[')
+        while ((c = escbyte()) >= 0x20 && c < 0x40)
+            ;   /* parameter and intermediate bytes, up to the final */
+    else if (c == 'O')
+        escbyte();
+}
+
+/*
+ * editline - Read a line from the terminal with simple editing:
+ * backspace, ^U (kill line), ^W (kill word), Tab (complete), ^R
+ * (replace the line with the newest earlier history entry containing
+ * it) and ^D on an empty line for end of file. Keys that send escape
+ * sequences are ignored. Return like readcmdline.
+ */
+int editline(char *buf, int size)
+{
+    struct termios saved, raw;
+    char pat[MAXLINE];
+    const char *rec;
+    int len = 0, n, rlen;
+    char c;
+
+    if (tcgetattr(STDIN_FILENO, &saved) < 0)
+        return readcmdline(buf, size);
+    raw = saved;
+    raw.c_lflag &= ~(ICANON | ECHO);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+    startexeindex();
+    pat[0] = '\0';
+    rsearchlimit = UINT32_MAX;
+
+    while (1) {
+        waitevents(1, NULL);
+        if ((n = read(STDIN_FILENO, &c, 1)) < 0 && errno == EINTR)
+            continue;
+        if (n <= 0 || (c == 4 && len == 0)) {      /* end of file */
+            len = 0;
+            break;
+        }
+        if (c != 18)
+            rsearchlimit = UINT32_MAX;
+        if (c == '\n' || c == '\r') {
+            write(STDOUT_FILENO, "\n", 1);
+            buf[len++] = '\n';
+            break;
+        }
+        else if (c == 127 || c == '\b') {
+            if (len > 0) {
+                len--;
+                write(STDOUT_FILENO, "\b \b", 3);
+            }
+        }
+        else if (c == 21) {
+            len = 0;
+            redraw(buf, len);
+        }
+        else if (c == 23) {
+            while (len > 0 && buf[len-1] == ' ')
+                len--;
+            while (len > 0 && buf[len-1] != ' ')
+                len--;
+            redraw(buf, len);
+        }
+        else if (c == '\t')
+            complete(buf, &len, size);
+        else if (c == 27)
+            skipescape();
+        else if (c == 18) {
+            if (rsearchlimit == UINT32_MAX)
+                snprintf(pat, sizeof(pat), "%.*s", len, buf);
+            rsearchfound = 0;
+            if (*pat && histrefresh() == 0)
+                histsearch(pat, lastmatch);
+            if (rsearchfound == 0) {
+                write(STDOUT_FILENO, "\a", 1);
+                continue;
+            }
+            rsearchlimit = rsearchfound - 1;
+            rec = histget(rsearchlimit, &rlen);
+            len = rlen < size - 2 ? rlen : size - 2;
+            memcpy(buf, rec, len);
+            redraw(buf, len);
+        }
+        else if ((unsigned char)c >= ' ' && len < size - 2) {
+            buf[len++] = c;
+            write(STDOUT_FILENO, &c, 1);
+        }
+    }
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &saved);
+    buf[len] = '\0';
+    return len;
+}
+/*********************************************
+ * end line editor and completion routines
+ *********************************************/
+
+
+/***********************
+ * Other helper routines
+ ***********************/
+
+/*
+ * usage - print a help message
+ */
+void usage(void)
+{
+    printf("Usage: shell [-hvp] [-c command [name [args ...]]] [script [args ...]]\n");
+    printf("   -h   print this message\n");
+    printf("   -v   print additional diagnostic information\n");
+    printf("   -p   do not emit a command prompt\n");
+    printf("   -c   run command and exit\n");
+    exit(1);
+}
+
+/*
+ * unix_error - unix-style error routine
+ */
+void unix_error(char *msg)
+{
+    fprintf(stdout, "%s: %s\n", msg, strerror(errno));
+    exit(1);
+}
+
+/*
+ * app_error - application-style error routine
+ */
+void app_error(char *msg)
+{
+    fprintf(stdout, "%s\n", msg);
+    exit(1);
+}
+
+/*
+ * Signal - wrapper for the sigaction function
+ */
+handler_t *Signal(int signum, handler_t *handler)
+{
+    struct sigaction action, old_action;
+
+    action.sa_handler = handler;
+    sigemptyset(&action.sa_mask); /* block sigs of type being handled */
+    action.sa_flags = SA_RESTART; /* restart syscalls if possible */
+
+    if (sigaction(signum, &action, &old_action) < 0)
     unix_error("Signal error");
     return (old_action.sa_handler);
 }
 
+/*
+ * notify - Report a job event to $TSH_EVENTFD, as "<kind> <pid>\n":
+ *     R  about to read a command     B  background job started
+ *     F  waiting for foreground job  S/T/X  job stopped/killed/exited
+ * Safe to call from a signal handler.
+ */
+void notify(char kind, pid_t pid)
+{
+    char buf[32], *p = buf + sizeof(buf);
+    int olderrno = errno;
+
+    if (notifyfd < 0)
+        return;
+    *--p = '\n';
+    do
+        *--p = '0' + pid % 10;
+    while ((pid /= 10) > 0);
+    *--p = ' ';
+    *--p = kind;
+    write(notifyfd, p, buf + sizeof(buf) - p);
+    errno = olderrno;
+}
+
 /*
  * sigquit_handler - The driver program can gracefully terminate the
  *    child shell by sending it a SIGQUIT signal.
@@ -0,0 +1,613 @@
+/*
+ * tshbench.c - Time tsh at the things it was made fast at
+ *
+ * usage: tshbench [-n <runs>] [-s <shell>]... [test ...]
+ *
+ * Each test writes a script, runs it under each shell (default: ./tsh,
+ * /bin/dash and /bin/bash, those that exist) <runs> times (default 5)
+ * and prints the median wall time of a run, or of one operation when
+ * the test can tell an operation's cost apart from the rest. The
+ * shells' output goes to /dev/null. With no test named, all are run.
+ *
+ *   env    Spawning /bin/true with 2000 exported variables
+ *   loop   1000000 iterations of a nested for loop of builtins, in
+ *          lines of the loop body run per second
+ *   capture  tsh only: the rate at which "capture on" passes the
+ *          output of one or eight background jobs through
+ *   pipe   tsh only: builtin pipeline stages on the thread pool
+ *          against forking them (TSH_POOL=0): "true | true | true |
+ *          /bin/true", and "export | /bin/cat" over 2000 variables
+ *   history  tsh only: "history -s" over NHIST commands: indexing
+ *          them from scratch, loading the checkpointed index, and
+ *          a search for a rare and for a common string
+ *   complete  Tab completion latency, at a terminal (a pty): a command
+ *          among 2000 on PATH and a file among 2000 in a directory.
+ *          Not dash, which has no completion.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+
+#define MAXSHELLS  16    /* max shells to compare */
+#define MAXRUNS   101    /* max runs of a script */
+#define CAPTUREMB 256    /* megabytes a job writes in the capture test */
+#define NCOMPLETE 200    /* completions timed per shell and kind */
+#define NFILES   2000    /* commands and files to complete among */
+#define NHIST 1000000    /* commands in the history test's history */
+
+/* A script under construction */
+struct script_t {
+    char *text;
+    size_t len, max;
+};
+
+char *shells[MAXSHELLS];
+int nshells = 0;
+int runs = 5;
+
+/* now - Seconds on the monotonic clock */
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* unix_error - unix-style error routine */
+static void unix_error(char *msg)
+{
+    fprintf(stderr, "%s: %s\n", msg, strerror(errno));
+    exit(2);
+}
+
+/* cmpdouble - qsort comparison for times */
+static int cmpdouble(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* add - Append printf-style text to a script */
+static void add(struct script_t *s, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    while (1) {
+        va_start(ap, fmt);
+        n = vsnprintf(s->text + s->len, s->max - s->len, fmt, ap);
+        va_end(ap);
+        if (s->len + n < s->max)
+            break;
+        s->max = (s->len + n + 1) * 2;
+        if ((s->text = realloc(s->text, s->max)) == NULL)
+            unix_error("realloc error");
+    }
+    s->len += n;
+}
+
+/*
+ * timescript - Run shell on the script <runs> times and return the
+ * median wall time in seconds
+ */
+static double timescript(const char *shell, struct script_t *s)
+{
+    char path[] = "/tmp/tshbenchXXXXXX";
+    double t[MAXRUNS], start;
+    pid_t pid;
+    int fd, i, status;
+
+    if ((fd = mkstemp(path)) < 0)
+        unix_error("mkstemp error");
+    if (write(fd, s->text, s->len) != (ssize_t)s->len)
+        unix_error("write error");
+    close(fd);
+    for (i = 0; i < runs; i++) {
+        start = now();
+        if ((pid = fork()) < 0)
+            unix_error("fork error");
+        if (pid == 0) {
+            if ((fd = open("/dev/null", O_WRONLY)) >= 0) {
+                dup2(fd, STDOUT_FILENO);
+                dup2(fd, STDERR_FILENO);
+            }
+            execl(shell, shell, path, (char *)NULL);
+            _exit(127);
+        }
+        if (waitpid(pid, &status, 0) < 0)
+            unix_error("waitpid error");
+        t[i] = now() - start;
+        if (!WIFEXITED(status) || WEXITSTATUS(status) == 127)
+            fprintf(stderr, "tshbench: %s failed on the script\n", shell);
+    }
+    unlink(path);
+    qsort(t, runs, sizeof(double), cmpdouble);
+    return t[runs / 2];
+}
+
+/* env - The cost of a spawn when there are 2000 exported variables */
+static void bench_env(void)
+{
+    struct script_t base = { 0 }, spawns = { 0 };
+    double t0, t1;
+    int i;
+
+    for (i = 0; i < 2000; i++)
+        add(&base, "export BENCHVAR%d=value-of-benchmark-variable-%d\n", i, i);
+    add(&spawns, "%s", base.text);
+    for (i = 0; i < 1000; i++)
+        add(&spawns, "/bin/true\n");
+    printf("env: /bin/true with 2000 exported variables, us per spawn\n");
+    for (i = 0; i < nshells; i++) {
+        t0 = timescript(shells[i], &base);
+        t1 = timescript(shells[i], &spawns);
+        printf("  %-20s %8.1f\n", shells[i], (t1 - t0) / 1000 * 1e6);
+    }
+    free(base.text);
+    free(spawns.text);
+}
+
+/* loop - The interpreter: 100x100x100 iterations of builtins, no forks */
+static void bench_loop(void)
+{
+    static const char *vars = "ijk";
+    static const int counts[] = { 100, 100, 100 };
+    struct script_t s = { 0 };
+    double t;
+    int i, j;
+
+    for (i = 0; i < 3; i++) {
+        add(&s, "%*sfor %c in", 2 * i, "", vars[i]);
+        for (j = 0; j < counts[i]; j++)
+            add(&s, " %d", j);
+        add(&s, "\n%*sdo\n", 2 * i, "");
+    }
+    add(&s, "      if test $i -lt $k; then true; else x=$j; fi\n");
+    for (i = 2; i >= 0; i--)
+        add(&s, "%*sdone\n", 2 * i, "");
+    printf("loop: 1000000 iterations of a nested for loop, body lines per second\n");
+    for (i = 0; i < nshells; i++) {
+        t = timescript(shells[i], &s);
+        printf("  %-20s %10.0f   (%.2f s)\n", shells[i], 1e6 / t, t);
+    }
+    free(s.text);
+}
+
+/*
+ * capture - How fast the capture spools pass output through: the
+ * time for jobs to write CAPTUREMB megabytes in all with capture on,
+ * less the time for the same jobs in the foreground without it
+ */
+static void bench_capture(void)
+{
+    static const struct { int writers, linelen; } cases[] = {
+        { 1, 40 }, { 1, 4096 }, { 8, 40 }
+    };
+    struct script_t plain = { 0 }, captured = { 0 };
+    double t0, t1;
+    int i, j, k;
+
+    printf("capture: %d MB of output through capture on, MB/s\n", CAPTUREMB);
+    for (i = 0; i < nshells; i++) {
+        if (strstr(shells[i], "tsh") == NULL)
+            continue;
+        printf("  %s\n", shells[i]);
+        for (j = 0; j < 3; j++) {
+            plain.len = captured.len = 0;
+            add(&captured, "capture on\n");
+            for (k = 0; k < cases[j].writers; k++) {
+                add(&plain, "/bin/sh -c 'yes $(printf %%0%dd %d) | head -c %d'\n",
+                    cases[j].linelen - 1, k, (CAPTUREMB << 20) / cases[j].writers);
+                add(&captured, "/bin/sh -c 'yes $(printf %%0%dd %d) | head -c %d' &\n",
+                    cases[j].linelen - 1, k, (CAPTUREMB << 20) / cases[j].writers);
+            }
+            for (k = 0; k < cases[j].writers; k++)
+                add(&captured, "fg %%%d\n", k + 1);
+            t0 = timescript(shells[i], &plain);
+            t1 = timescript(shells[i], &captured);
+            printf("    %d writer%s, %4d-byte lines %8.0f\n", cases[j].writers,
+                   cases[j].writers > 1 ? "s" : " ", cases[j].linelen,
+                   t1 > t0 ? CAPTUREMB / (t1 - t0) : 0);
+        }
+    }
+    free(plain.text);
+    free(captured.text);
+}
+
+/*
+ * pipe - What running builtin stages on threads saves over forking
+ * them: the time per pipeline, less that of the same script without
+ * the pipelines
+ */
+static void bench_pipe(void)
+{
+    static const char *modes[] = { "threads", "fork" };
+    struct script_t base = { 0 }, vars = { 0 }, setup = { 0 }, list = { 0 };
+    double t0, t1, t2, t3;
+    int i, j, k;
+
+    printf("pipe: builtin stages on threads or forked, us per pipeline\n");
+    for (i = 0; i < nshells; i++) {
+        if (strstr(shells[i], "tsh") == NULL)
+            continue;
+        printf("  %-18s %30s %18s\n", shells[i], "true | true | true | /bin/true",
+               "export | /bin/cat");
+        for (j = 0; j < 2; j++) {
+            base.len = vars.len = setup.len = list.len = 0;
+            add(&base, "%s", j == 1 ? "TSH_POOL=0\n" : ":\n");
+            add(&vars, "%s", base.text);
+            for (k = 0; k < 2000; k++)
+                add(&vars, "export BENCHVAR%d=value-of-benchmark-variable-%d\n", k, k);
+            add(&setup, "%s", base.text);
+            for (k = 0; k < 1000; k++)
+                add(&setup, "true | true | true | /bin/true\n");
+            add(&list, "%s", vars.text);
+            for (k = 0; k < 200; k++)
+                add(&list, "export | /bin/cat\n");
+            t0 = timescript(shells[i], &base);
+            t1 = timescript(shells[i], &setup);
+            t2 = timescript(shells[i], &vars);
+            t3 = timescript(shells[i], &list);
+            printf("    %-16s %30.1f %18.1f\n", modes[j],
+                   (t1 - t0) / 1000 * 1e6, (t3 - t2) / 200 * 1e6);
+        }
+    }
+    free(base.text);
+    free(vars.text);
+    free(setup.text);
+    free(list.text);
+}
+
+/* histcheck - The check word of a tsh history record (as in tsh.c) */
+static uint32_t histcheck(const char *p, uint32_t len)
+{
+    uint32_t h = 2166136261u ^ len;
+
+    while (len-- > 0)
+        h = (h ^ (unsigned char)*p++) * 16777619u;
+    return h;
+}
+
+/*
+ * histcheckpoint - Have shell, with piped input, which tsh takes as
+ * interactive since TSH_HISTFILE is set, search the history once and
+ * checkpoint its index at exit
+ */
+static void histcheckpoint(const char *shell)
+{
+    static const char cmd[] = "history -s checkpoint\n";
+    int fd[2], null;
+    pid_t pid;
+
+    if (pipe(fd) < 0 || (pid = fork()) < 0)
+        unix_error("histcheckpoint error");
+    if (pid == 0) {
+        dup2(fd[0], STDIN_FILENO);
+        if ((null = open("/dev/null", O_WRONLY)) >= 0)
+            dup2(null, STDOUT_FILENO);
+        close(fd[0]);
+        close(fd[1]);
+        execl(shell, shell, (char *)NULL);
+        _exit(127);
+    }
+    close(fd[0]);
+    if (write(fd[1], cmd, sizeof(cmd) - 1) < 0)
+        unix_error("write error");
+    close(fd[1]);
+    waitpid(pid, NULL, 0);
+}
+
+/*
+ * history - History search over NHIST commands. Each time is the
+ * median script's, less that of a script that does not search: the
+ * first search of a session, with no checkpoint (which indexes every
+ * record) and with one; and then each further search
+ */
+static void bench_history(void)
+{
+    static const char *fmts[] = {
+        "make -j4 target%d", "git commit -m 'change %d'", "cd ~/src/project%d",
+        "ls -la /tmp/file%d.txt", "grep -rn pattern%d src/", "./myspin %d &",
+    };
+    char path[] = "/tmp/tshbenchXXXXXX", idx[64], line[128], hdr[8];
+    struct script_t empty = { 0 }, one = { 0 }, rare = { 0 }, common = { 0 };
+    double t0, tcold, twarm, trare, tcommon;
+    uint32_t len, check;
+    FILE *fp;
+    int fd, i;
+
+    if ((fd = mkstemp(path)) < 0 || (fp = fdopen(fd, "w")) == NULL)
+        unix_error("mkstemp error");
+    for (i = 0; i < NHIST; i++) {
+        if (i == NHIST / 2)
+            snprintf(line, sizeof(line), "echo needle-in-the-history");
+        else
+            snprintf(line, sizeof(line), fmts[i % 6], i);
+        len = strlen(line);
+        check = histcheck(line, len);
+        memcpy(hdr, &len, 4);
+        memcpy(hdr + 4, &check, 4);
+        fwrite(hdr, 8, 1, fp);
+        fwrite(line, len, 1, fp);
+    }
+    if (fclose(fp) != 0)
+        unix_error("write error");
+    snprintf(idx, sizeof(idx), "%s.idx", path);
+    setenv("TSH_HISTFILE", path, 1);
+
+    add(&empty, ":\n");
+    add(&one, "history -s needle-in\n");
+    add(&rare, "%s", one.text);
+    add(&common, "%s", one.text);
+    for (i = 0; i < 1000; i++)
+        add(&rare, "history -s needle-in\n");
+    for (i = 0; i < 100; i++)
+        add(&common, "history -s commit\n");
+
+    printf("history: %d commands, ms for the first search of a session and per search\n", NHIST);
+    for (i = 0; i < nshells; i++) {
+        if (strstr(shells[i], "tsh") == NULL)
+            continue;
+        unlink(idx);
+        t0 = timescript(shells[i], &empty);
+        tcold = timescript(shells[i], &one);
+        histcheckpoint(shells[i]);
+        twarm = timescript(shells[i], &one);
+        trare = timescript(shells[i], &rare);
+        tcommon = timescript(shells[i], &common);
+        printf("  %s\n", shells[i]);
+        printf("    %-36s %8.2f\n", "first, indexing every record", (tcold - t0) * 1e3);
+        printf("    %-36s %8.2f\n", "first, from the checkpoint", (twarm - t0) * 1e3);
+        printf("    %-36s %8.3f\n", "then a rare string (1 hit)", (trare - twarm) / 1000 * 1e3);
+        snprintf(line, sizeof(line), "then a common one (%d hits)", NHIST / 6);
+        printf("    %-36s %8.2f\n", line, (tcommon - twarm) / 100 * 1e3);
+    }
+    unsetenv("TSH_HISTFILE");
+    unlink(idx);
+    unlink(path);
+    free(empty.text);
+    free(one.text);
+    free(rare.text);
+    free(common.text);
+}
+
+/*
+ * ptyshell - Start shell interactively on a new pty. Return the
+ * master side, with the shell's pid in *pid.
+ */
+static int ptyshell(const char *shell, const char *dir, pid_t *pid)
+{
+    char path[64], *search;
+    int fd, slave;
+
+    if ((fd = posix_openpt(O_RDWR | O_NOCTTY)) < 0 || grantpt(fd) < 0 ||
+        unlockpt(fd) < 0 || ptsname_r(fd, path, sizeof(path)) != 0)
+        unix_error("pty error");
+    if ((*pid = fork()) < 0)
+        unix_error("fork error");
+    if (*pid == 0) {
+        setsid();
+        if ((slave = open(path, O_RDWR)) < 0)
+            _exit(127);
+        ioctl(slave, TIOCSCTTY, 0);
+        dup2(slave, STDIN_FILENO);
+        dup2(slave, STDOUT_FILENO);
+        dup2(slave, STDERR_FILENO);
+        close(fd);
+        if (asprintf(&search, "%s:%s", dir, getenv("PATH")) > 0)
+            setenv("PATH", search, 1);
+        setenv("TSH_HISTFILE", "/dev/null", 1);
+        setenv("HISTFILE", "/dev/null", 1);
+        setenv("PS1", "tsh> ", 1);
+        setenv("TSHBENCH_SYNC", "sync", 1);
+        if (strstr(shell, "bash") != NULL)
+            execl(shell, shell, "--norc", "--noprofile", "-i", (char *)NULL);
+        else
+            execl(shell, shell, (char *)NULL);
+        _exit(127);
+    }
+    return fd;
+}
+
+/*
+ * ptywait - Read the pty until what it has sent since the call has
+ * want in it, followed by after if that is not NULL. -1 after 5 s.
+ */
+static int ptywait(int fd, const char *want, const char *after)
+{
+    static char buf[65536];
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    size_t len = 0;
+    ssize_t n;
+    char *p;
+
+    while (1) {
+        if (poll(&pfd, 1, 5000) <= 0 || (n = read(fd, buf + len, sizeof(buf) - 1 - len)) <= 0)
+            return -1;
+        len += n;
+        buf[len] = '\0';
+        if ((p = strstr(buf, want)) != NULL &&
+            (after == NULL || strstr(p + strlen(want), after) != NULL))
+            return 0;
+        if (len > sizeof(buf) / 2) {    /* keep only the tail */
+            memmove(buf, buf + len - 256, 256);
+            len = 256;
+        }
+    }
+}
+
+/*
+ * ptysync - Kill the line being edited and wait until the shell has
+ * run a command and prompted again: the output of "echo
+ * $TSHBENCH_SYNC i" is not what the terminal echoes as it is typed
+ */
+static int ptysync(int fd, int i)
+{
+    char buf[64];
+
+    snprintf(buf, sizeof(buf), "\025echo $TSHBENCH_SYNC %d\r", i);
+    if (write(fd, buf, strlen(buf)) < 0)
+        unix_error("pty write error");
+    snprintf(buf, sizeof(buf), "sync %d\r\n", i);
+    return ptywait(fd, buf, "tsh> ");
+}
+
+/*
+ * timecompletions - Type prefix and Tab at shell NCOMPLETE times, and
+ * return the median time from the Tab to the rest of the word
+ */
+static double timecompletions(int fd, const char *prefix, const char *rest)
+{
+    double t[NCOMPLETE], start;
+    int i;
+
+    for (i = 0; i < NCOMPLETE; i++) {
+        if (write(fd, prefix, strlen(prefix)) < 0)
+            unix_error("pty write error");
+        if (ptywait(fd, prefix + strlen(prefix) - 1, NULL) < 0)
+            return -1;
+        start = now();
+        if (write(fd, "\t", 1) < 0)
+            unix_error("pty write error");
+        if (ptywait(fd, rest, NULL) < 0)
+            return -1;
+        t[i] = now() - start;
+        if (ptysync(fd, i) < 0)
+            return -1;
+    }
+    qsort(t, NCOMPLETE, sizeof(double), cmpdouble);
+    return t[NCOMPLETE / 2];
+}
+
+/* complete - Tab completion latency at a terminal */
+static void bench_complete(void)
+{
+    char dir[] = "/tmp/tshbenchXXXXXX", path[64], prefix[96];
+    double tcmd, tfile;
+    pid_t pid;
+    int i, fd;
+
+    if (mkdtemp(dir) == NULL)
+        unix_error("mkdtemp error");
+    for (i = 0; i <= NFILES; i++) {
+        if (i < NFILES)
+            snprintf(path, sizeof(path), "%s/benchcmd%04d", dir, i);
+        else
+            snprintf(path, sizeof(path), "%s/zzbenchonly", dir);
+        if ((fd = open(path, O_WRONLY | O_CREAT, 0755)) < 0)
+            unix_error("open error");
+        close(fd);
+    }
+    printf("complete: Tab at a terminal, among %d names, median us\n", NFILES);
+    for (i = 0; i < nshells; i++) {
+        if (strstr(shells[i], "dash") != NULL)
+            continue;
+        /* give tsh time to index PATH, as a person would */
+        fd = ptyshell(shells[i], dir, &pid);
+        if (ptysync(fd, -1) < 0 || usleep(500000) < 0 || ptysync(fd, -2) < 0) {
+            printf("  %-20s did not start\n", shells[i]);
+            kill(pid, SIGKILL);
+        }
+        else {
+            tcmd = timecompletions(fd, "zzbenc", "honly");
+            snprintf(prefix, sizeof(prefix), "true %s/zzbenc", dir);
+            tfile = timecompletions(fd, prefix, "honly");
+            printf("  %-20s command %8.1f   file %8.1f\n", shells[i],
+                   tcmd * 1e6, tfile * 1e6);
+            kill(pid, SIGKILL);
+        }
+        close(fd);
+        waitpid(pid, NULL, 0);
+    }
+    for (i = 0; i <= NFILES; i++) {
+        if (i < NFILES)
+            snprintf(path, sizeof(path), "%s/benchcmd%04d", dir, i);
+        else
+            snprintf(path, sizeof(path), "%s/zzbenchonly", dir);
+        unlink(path);
+    }
+    rmdir(dir);
+}
+
+/* The tests, in the order they run */
+struct test_t {
+    char *name;
+    void (*run)(void);
+} tests[] = {
+    { "env", bench_env },
+    { "loop", bench_loop },
+    { "capture", bench_capture },
+    { "pipe", bench_pipe },
+    { "history", bench_history },
+    { "complete", bench_complete },
+    { NULL, NULL }
+};
+
+/* usage - print a help message */
+static void usage(void)
+{
+    int i;
+
+    printf("Usage: tshbench [-n <runs>] [-s <shell>]... [test ...]\n");
+    printf("   -n   run each script <runs> times (default 5)\n");
+    printf("   -s   a shell to time (default ./tsh, /bin/dash, /bin/bash)\n");
+    printf("tests:");
+    for (i = 0; tests[i].name != NULL; i++)
+        printf(" %s", tests[i].name);
+    printf("\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    static char *defaults[] = { "./tsh", "/bin/dash", "/bin/bash" };
+    int c, i, j;
+
+    while ((c = getopt(argc, argv, "hn:s:")) != EOF) {
+        switch (c) {
+        case 'n':
+            if ((runs = atoi(optarg)) <= 0 || runs > MAXRUNS)
+                usage();
+            break;
+        case 's':
+            if (nshells < MAXSHELLS)
+                shells[nshells++] = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (nshells == 0)
+        for (i = 0; i < 3; i++)
+            if (access(defaults[i], X_OK) == 0)
+                shells[nshells++] = defaults[i];
+
+    for (j = optind; j < argc; j++) {
+        for (i = 0; tests[i].name != NULL && strcmp(argv[j], tests[i].name); i++)
+            ;
+        if (tests[i].name == NULL)
+            usage();
+    }
+    for (i = 0; tests[i].name != NULL; i++) {
+        for (j = optind; j < argc && strcmp(argv[j], tests[i].name); j++)
+            ;
+        if (optind == argc || j < argc)
+            tests[i].run();
+    }
+    exit(0);
+}
@@ -0,0 +1,218 @@
+/*
+ * tshscan.c - Check the vector scanset routines against the scalar
+ *             one, and time them all
+ *
+ * usage: tshscan [-n <cases>] [-r <seed>]
+ *
+ * Builds tsh.c into itself (its main renamed) to get at scan_scalar,
+ * scan_sse2 and scan_avx2. Each of <cases> random cases (default
+ * 1000000) puts a random string at a random alignment, often ending
+ * on the last byte before an unmapped page, and scans it from a random
+ * offset for a random set of 0 to MAXSET+3 bytes; every routine the
+ * CPU supports must return the pointer scan_scalar does. The strings
+ * and sets are drawn mostly from the bytes tsh scans for, so that
+ * there are hits to find. A failing case is printed and the exit
+ * status is 1. Then each routine is timed on a 1 MB line with no hit
+ * (MB/s) and on the short words tsh mostly sees (ns per call).
+ */
+#define main tsh_main
+#define usage tsh_usage
+#include "tsh.c"
+#undef main
+#undef usage
+
+#define BUFPAGES   2      /* mapped pages before the guard page */
+#define LONGLINE   (1<<20) /* the throughput test's line */
+#define SETCHARS   " \t'\";$|&<>a\x80\xff"
+
+/* One scanset implementation */
+struct scanner_t {
+    char *name;
+    char *(*scan)(const char *p, const char *set);
+    int ok;                 /* the CPU can run it */
+};
+
+struct scanner_t scanners[] = {
+    { "scalar", scan_scalar, 1 },
+#if defined(__x86_64__) || defined(__i386__)
+    { "sse2", scan_sse2, 0 },
+    { "avx2", scan_avx2, 0 },
+#endif
+    { NULL, NULL, 0 }
+};
+
+/* now - Seconds on the monotonic clock */
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* randbyte - A byte to scan, usually one tsh looks for, never '\0' */
+static char randbyte(void)
+{
+    char c;
+
+    if (random() % 4)
+        return SETCHARS[random() % (sizeof(SETCHARS) - 1)];
+    while ((c = random()) == '\0')
+        ;
+    return c;
+}
+
+/* dumpcase - Print a failing case */
+static void dumpcase(const char *str, const char *p, const char *set)
+{
+    const char *s;
+
+    printf("  string (scanned from byte %d):", (int)(p - str));
+    for (s = str; *s; s++)
+        printf(" %02x", (unsigned char)*s);
+    printf("\n  set:");
+    for (s = set; *s; s++)
+        printf(" %02x", (unsigned char)*s);
+    printf("\n");
+}
+
+/*
+ * fuzz - Run n random cases through every scanner. Return the number
+ * that failed.
+ */
+static int fuzz(long n)
+{
+    long pagesize = sysconf(_SC_PAGESIZE), i;
+    size_t size = BUFPAGES * pagesize;
+    char *buf, *str, *p, *want, *got;
+    char set[MAXSET + 4];
+    int j, len, setlen, failed = 0;
+
+    /* The strings live just below a page that faults if it is read */
+    buf = mmap(NULL, size + pagesize, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf == MAP_FAILED)
+        unix_error("mmap error");
+    if (mprotect(buf + size, pagesize, PROT_NONE) < 0)
+        unix_error("mprotect error");
+
+    for (i = 0; i < n; i++) {
+        len = random() % (random() % 8 ? 80 : size - 1);
+        if (random() % 2)
+            str = buf + size - len - 1;
+        else
+            str = buf + random() % (size - len);
+        for (j = 0; j < len; j++)
+            str[j] = randbyte();
+        str[len] = '\0';
+        p = str + (len ? random() % (len + 1) : 0);
+        setlen = random() % (MAXSET + 4);
+        for (j = 0; j < setlen; j++)
+            set[j] = randbyte();
+        set[setlen] = '\0';
+
+        want = scan_scalar(p, set);
+        for (j = 1; scanners[j].name != NULL; j++) {
+            if (!scanners[j].ok || (got = scanners[j].scan(p, set)) == want)
+                continue;
+            printf("%s returned byte %d, scalar byte %d\n", scanners[j].name,
+                   (int)(got - str), (int)(want - str));
+            dumpcase(str, p, set);
+            if (++failed == 10)
+                return failed;
+        }
+    }
+    munmap(buf, size + pagesize);
+    return failed;
+}
+
+/* bench - Time every scanner on a long line and on short words */
+static void bench(void)
+{
+    static const char *words[] = { "echo", "hello", "$HOME/bin", "'a b'",
+                                   "-la", "foo.c;", "x=1", "/usr/bin/env" };
+    char *line;
+    double t;
+    long k, reps;
+    int j, w;
+
+    if ((line = malloc(LONGLINE + 1)) == NULL)
+        unix_error("malloc error");
+    memset(line, 'a', LONGLINE);
+    line[LONGLINE] = '\0';
+
+    printf("%-8s %10s %14s\n", "scanner", "MB/s", "ns per word");
+    for (j = 0; scanners[j].name != NULL; j++) {
+        if (!scanners[j].ok)
+            continue;
+        reps = 0;
+        t = now();
+        do {
+            for (k = 0; k < 16; k++, reps++)
+                if (*scanners[j].scan(line, " \t'\";$") != '\0')
+                    exit(2);
+        } while (now() - t < 0.5);
+        printf("%-8s %10.0f", scanners[j].name,
+               reps * (LONGLINE / 1e6) / (now() - t));
+
+        reps = 0;
+        t = now();
+        do {
+            for (k = 0; k < 4096; k++, reps++)
+                for (w = 0; w < 8; w++)
+                    scanners[j].scan(words[w], " \t'\";$");
+        } while (now() - t < 0.5);
+        printf(" %14.1f\n", (now() - t) / (reps * 8) * 1e9);
+    }
+    free(line);
+}
+
+/* scanusage - print a help message */
+static void scanusage(void)
+{
+    printf("Usage: tshscan [-n <cases>] [-r <seed>]\n");
+    printf("   -n   random cases to check (default 1000000)\n");
+    printf("   -r   random seed (default: the time)\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned seed = time(NULL);
+    long cases = 1000000;
+    int c, j, failed;
+
+    while ((c = getopt(argc, argv, "hn:r:")) != EOF) {
+        switch (c) {
+        case 'n':
+            if ((cases = atol(optarg)) < 0)
+                scanusage();
+            break;
+        case 'r':
+            seed = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            scanusage();
+        }
+    }
+
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    scanners[1].ok = __builtin_cpu_supports("sse2");
+    scanners[2].ok = __builtin_cpu_supports("avx2");
+#endif
+    printf("checking");
+    for (j = 1; scanners[j].name != NULL; j++)
+        if (scanners[j].ok)
+            printf(" %s", scanners[j].name);
+    printf(" against scalar: %ld cases, seed %u\n", cases, seed);
+    fflush(stdout);
+    srandom(seed);
+    if ((failed = fuzz(cases)) > 0) {
+        printf("%d cases failed\n", failed);
+        exit(1);
+    }
+    printf("all cases match\n");
+    bench();
+    exit(0);
+}
@@ -0,0 +1,158 @@
+/*
+ * tshstart.c - Time how long a shell takes to start, run one command
+ *              and exit
+ *
+ * usage: tshstart [-n <runs>] [-c <command>] [shell ...]
+ *
+ * Spawns each shell (default: ./tsh, /bin/dash and /bin/bash) as
+ * "shell -c <command>" (default: true) <runs> times (default 1000),
+ * taking turns so that the machine's mood is shared fairly, and
+ * prints the minimum, median and 99th percentile of the time from
+ * posix_spawn to the shell being reaped, with the page faults each
+ * run took. The shell's output goes to /dev/null.
+ *
+ * For the fastest start, link tsh statically ("make tsh-static"):
+ * there is then no dynamic loader to run and far fewer pages to
+ * fault in. "make startup" compares both builds with dash and bash.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#define MAXSHELLS  16    /* max shells to compare */
+
+extern char **environ;
+
+/* One shell being timed */
+struct shell_t {
+    char *path;
+    double *usecs;          /* latency of each run */
+    long faults;            /* page faults over all runs */
+    int failed;             /* runs that did not exit 0 */
+};
+
+struct shell_t shells[MAXSHELLS];
+int nshells = 0;
+int runs = 1000;
+char *command = "true";
+
+/* now - Microseconds on the monotonic clock */
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* unix_error - unix-style error routine */
+static void unix_error(char *msg)
+{
+    fprintf(stderr, "%s: %s\n", msg, strerror(errno));
+    exit(2);
+}
+
+/* cmpdouble - qsort comparison for latencies */
+static int cmpdouble(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* runonce - Spawn a shell once and return how long it took, in us */
+static double runonce(struct shell_t *s, posix_spawn_file_actions_t *fa)
+{
+    char *argv[] = { s->path, "-c", command, NULL };
+    struct rusage ru;
+    double start;
+    pid_t pid;
+    int status, err;
+
+    start = now();
+    if ((err = posix_spawn(&pid, s->path, fa, NULL, argv, environ)) != 0) {
+        errno = err;
+        unix_error(s->path);
+    }
+    if (wait4(pid, &status, 0, &ru) < 0)
+        unix_error("wait4 error");
+    s->faults += ru.ru_minflt + ru.ru_majflt;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        s->failed++;
+    return now() - start;
+}
+
+/* usage - print a help message */
+static void usage(void)
+{
+    printf("Usage: tshstart [-n <runs>] [-c <command>] [shell ...]\n");
+    printf("   -n   spawn each shell <runs> times (default 1000)\n");
+    printf("   -c   the command each shell runs (default true)\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    static char *defaults[] = { "./tsh", "/bin/dash", "/bin/bash" };
+    posix_spawn_file_actions_t fa;
+    struct shell_t *s;
+    int c, i, j;
+
+    while ((c = getopt(argc, argv, "hn:c:")) != EOF) {
+        switch (c) {
+        case 'n':
+            if ((runs = atoi(optarg)) <= 0)
+                usage();
+            break;
+        case 'c':
+            command = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+
+    for (i = optind; i < argc && nshells < MAXSHELLS; i++)
+        shells[nshells++].path = argv[i];
+    if (nshells == 0)
+        for (i = 0; i < 3; i++)
+            if (access(defaults[i], X_OK) == 0)
+                shells[nshells++].path = defaults[i];
+    for (i = 0; i < nshells; i++)
+        if ((shells[i].usecs = calloc(runs, sizeof(double))) == NULL)
+            unix_error("calloc error");
+
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_addopen(&fa, 1, "/dev/null", O_WRONLY, 0);
+
+    /* Once each to warm the page cache, then the timed rounds */
+    for (i = 0; i < nshells; i++)
+        runonce(&shells[i], &fa);
+    for (i = 0; i < nshells; i++)
+        shells[i].faults = shells[i].failed = 0;
+    for (j = 0; j < runs; j++)
+        for (i = 0; i < nshells; i++)
+            shells[i].usecs[j] = runonce(&shells[i], &fa);
+
+    printf("%-24s %9s %9s %9s %7s\n", "shell", "min us", "median", "p99", "faults");
+    for (i = 0; i < nshells; i++) {
+        s = &shells[i];
+        qsort(s->usecs, runs, sizeof(double), cmpdouble);
+        printf("%-24s %9.1f %9.1f %9.1f %7.1f", s->path, s->usecs[0],
+               s->usecs[runs / 2], s->usecs[runs * 99 / 100],
+               (double)s->faults / runs);
+        if (s->failed)
+            printf("  (%d runs failed)", s->failed);
+        printf("\n");
+    }
+    exit(0);
+}
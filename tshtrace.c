@@ -0,0 +1,508 @@
+/*
+ * tshtrace.c - Replay the trace files against a shell, all at once
+ *
+ * usage: tshtrace [-v] [-s <shell>] [-a <args>] [-r <reference>] [trace ...]
+ *
+ * Does what sdriver.pl does for each trace (default: trace??.txt), but
+ * runs every trace at the same time, each against its own shell in
+ * its own session. Instead of sleeping, "SLEEP <n>" waits until the
+ * shell has read every command sent so far and is either idle or
+ * waiting for a foreground job; the shell reports that through the
+ * events it writes to $TSH_EVENTFD (see notify in tsh.c). A shell that
+ * sends no events gets the full sleep, as with sdriver.pl.
+ *
+ * The output of each trace is compared with its section of the
+ * reference output (default tshref.out) after replacing process IDs
+ * and dropping ps(1) listings, and a line of numbers is printed:
+ * wall time, shell CPU time (including the jobs it reaped) and the
+ * latency of each command, from the shell reading it to the shell
+ * asking for the next one. -v lists every command's latency. The
+ * exit status is 1 if any trace differs from the reference.
+ *
+ * A shell older than its source (./tsh against tsh.c by default) is
+ * refused: "make check" builds it first, then runs this.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#define MAXLINE  1024    /* max line size */
+#define MAXCMDS   256    /* max commands in a trace */
+#define MAXPIDS   256    /* max jobs a trace starts */
+#define MAXARGS    32    /* max shell arguments */
+
+/* The state of one replay */
+struct replay_t {
+    pid_t shell;            /* the shell's PID */
+    int in, out, ev;        /* shell stdin, stdout+stderr and events */
+    char *output;           /* everything the shell printed */
+    size_t outlen, outmax;
+    char evline[64];        /* partial event line */
+    int evlen;
+    int events;             /* number of events seen */
+    int ready;              /* number of R events: commands asked for */
+    int fgwait;             /* the shell is waiting for a foreground job */
+    int sent;               /* commands written to the shell */
+    double tsent[MAXCMDS + 2];   /* when each command was sent */
+    double tready[MAXCMDS + 2];  /* when the shell asked for each one */
+    char *cmds[MAXCMDS + 1];     /* command text, for -v */
+    pid_t pids[MAXPIDS];    /* jobs, to clean up after */
+    int npids;
+    int exited;             /* the shell has been reaped */
+    struct rusage ru;       /* its resource usage */
+};
+
+char *shellprog = "./tsh";
+char *shellargs[MAXARGS] = { NULL, "-p", NULL };
+char *reference = "tshref.out";
+int verbose = 0;
+
+/* now - Seconds on the monotonic clock */
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* unix_error - unix-style error routine */
+static void unix_error(char *msg)
+{
+    fprintf(stderr, "%s: %s\n", msg, strerror(errno));
+    exit(2);
+}
+
+/* addpid - Remember a job so it can be killed at the end */
+static void addpid(struct replay_t *r, pid_t pid)
+{
+    int i;
+
+    for (i = 0; i < r->npids; i++)
+        if (r->pids[i] == pid)
+            return;
+    if (r->npids < MAXPIDS)
+        r->pids[r->npids++] = pid;
+}
+
+/* event - Act on one event line from the shell */
+static void event(struct replay_t *r, char *line)
+{
+    pid_t pid = atoi(line + 2);
+
+    r->events++;
+    switch (line[0]) {
+    case 'R':
+        r->ready++;
+        if (r->ready <= MAXCMDS + 1)
+            r->tready[r->ready] = now();
+        r->fgwait = 0;
+        break;
+    case 'F':
+        r->fgwait = 1;
+        addpid(r, pid);
+        break;
+    case 'B':
+        addpid(r, pid);
+        break;
+    }
+}
+
+/*
+ * pump - Collect shell output and events for up to timeout ms (0:
+ * just what is there, -1: until something arrives). Notices when
+ * the shell exits.
+ */
+static void pump(struct replay_t *r, int timeout)
+{
+    struct pollfd pfd[2];
+    char buf[4096];
+    ssize_t n;
+    int i;
+
+    pfd[0].fd = r->out;
+    pfd[1].fd = r->ev;
+    pfd[0].events = pfd[1].events = POLLIN;
+    if (poll(pfd, 2, timeout) < 0 && errno != EINTR)
+        unix_error("poll error");
+
+    while (r->out >= 0 && (n = read(r->out, buf, sizeof(buf))) > 0) {
+        if (r->outlen + n > r->outmax) {
+            r->outmax = 2 * (r->outlen + n);
+            if ((r->output = realloc(r->output, r->outmax)) == NULL)
+                unix_error("realloc error");
+        }
+        memcpy(r->output + r->outlen, buf, n);
+        r->outlen += n;
+    }
+    while (r->ev >= 0 && (n = read(r->ev, buf, sizeof(buf))) > 0) {
+        for (i = 0; i < n; i++) {
+            if (buf[i] == '\n' || r->evlen == (int)sizeof(r->evline) - 1) {
+                r->evline[r->evlen] = '\0';
+                event(r, r->evline);
+                r->evlen = 0;
+            }
+            else
+                r->evline[r->evlen++] = buf[i];
+        }
+    }
+    if (!r->exited && wait4(r->shell, NULL, WNOHANG, &r->ru) == r->shell)
+        r->exited = 1;
+}
+
+/* settled - Has the shell read everything and gone to sleep? */
+static int settled(struct replay_t *r)
+{
+    return r->ready > r->sent || (r->ready == r->sent && r->fgwait);
+}
+
+/* startshell - Run the shell in its own session, wired up to r */
+static void startshell(struct replay_t *r)
+{
+    int in[2], out[2], ev[2];
+
+    if (pipe2(in, O_CLOEXEC) < 0 || pipe2(out, O_CLOEXEC) < 0 || pipe2(ev, O_CLOEXEC) < 0)
+        unix_error("pipe error");
+    if ((r->shell = fork()) < 0)
+        unix_error("fork error");
+    if (r->shell == 0) {
+        setsid();
+        dup2(in[0], 0);
+        dup2(out[1], 1);
+        dup2(out[1], 2);
+        dup2(ev[1], 3);
+        fcntl(3, F_SETFD, 0);
+        setenv("TSH_EVENTFD", "3", 1);
+        shellargs[0] = shellprog;
+        execv(shellprog, shellargs);
+        fprintf(stderr, "%s: %s\n", shellprog, strerror(errno));
+        _exit(127);
+    }
+    close(in[0]);
+    close(out[1]);
+    close(ev[1]);
+    r->in = in[1];
+    r->out = out[0];
+    r->ev = ev[0];
+    fcntl(r->out, F_SETFL, O_NONBLOCK);
+    fcntl(r->ev, F_SETFL, O_NONBLOCK);
+}
+
+/* waitshell - Pump until the shell exits, killing it after secs */
+static void waitshell(struct replay_t *r, double secs)
+{
+    double end = now() + secs;
+
+    while (!r->exited) {
+        if (now() > end)
+            kill(r->shell, SIGKILL);
+        pump(r, 50);
+    }
+}
+
+/*
+ * replay - Run one trace. The comment lines and then the shell's
+ * output go to *text.
+ */
+static void replay(const char *trace, struct replay_t *r, char **text, size_t *len)
+{
+    char line[MAXLINE];
+    FILE *in, *out;
+    double end;
+    int i, secs;
+
+    if ((in = fopen(trace, "r")) == NULL)
+        unix_error((char *)trace);
+    if ((out = open_memstream(text, len)) == NULL)
+        unix_error("open_memstream error");
+    signal(SIGPIPE, SIG_IGN);
+    startshell(r);
+
+    while (fgets(line, MAXLINE, in) != NULL) {
+        pump(r, 0);
+        if (line[0] == '#')
+            fputs(line, out);
+        else if (line[strspn(line, " \t\r\n")] == '\0')
+            continue;
+        else if (strstr(line, "TSTP"))
+            kill(r->shell, SIGTSTP);
+        else if (strstr(line, "INT"))
+            kill(r->shell, SIGINT);
+        else if (strstr(line, "QUIT"))
+            kill(r->shell, SIGQUIT);
+        else if (strstr(line, "KILL"))
+            kill(r->shell, SIGKILL);
+        else if (strstr(line, "CLOSE")) {
+            close(r->in);
+            r->in = -1;
+        }
+        else if (strstr(line, "WAIT"))
+            waitshell(r, 60);
+        else if (sscanf(line, "SLEEP %d", &secs) == 1) {
+            /* a shell that sends no events sleeps the full time */
+            end = now() + secs;
+            while (now() < end && !r->exited && !(r->events > 0 && settled(r)))
+                pump(r, 10);
+        }
+        else if (r->in >= 0 && r->sent < MAXCMDS) {
+            r->cmds[++r->sent] = strdup(line);
+            r->tsent[r->sent] = now();
+            write(r->in, line, strlen(line));
+        }
+    }
+    fclose(in);
+
+    /* Like sdriver.pl: close the shell's input and collect the rest */
+    if (r->in >= 0)
+        close(r->in);
+    waitshell(r, 60);
+    pump(r, 0);
+    for (i = 0; i < r->npids; i++)
+        kill(-r->pids[i], SIGKILL);
+    fwrite(r->output, 1, r->outlen, out);
+    fclose(out);
+}
+
+/* normalize - Return text rewritten for comparison, freeing it: PIDs
+   become "(PID)" and ps(1) output lines are dropped */
+static char *normalize(char *text)
+{
+    char *out, *src = text, *dst, *eol, *p;
+    int pslike;
+
+    /* "(PID)" is longer than a PID of one or two digits */
+    if ((out = malloc(2 * strlen(text) + 1)) == NULL)
+        unix_error("malloc error");
+    dst = out;
+
+    while (*src) {
+        eol = strchrnul(src, '\n');
+        /* "  PID TTY  STAT  TIME COMMAND" or a process line */
+        p = src + strspn(src, " ");
+        pslike = (!strncmp(p, "PID TTY", 7)) ||
+                 (isdigit((unsigned char)*p) && memmem(src, eol - src, ":", 1) &&
+                  (memmem(src, eol - src, " pts/", 5) || memmem(src, eol - src, " tty", 4) ||
+                   memmem(src, eol - src, " ?", 2)));
+        if (!pslike) {
+            while (src < eol) {
+                if (*src == '(' && isdigit((unsigned char)src[1])) {
+                    for (p = src + 1; isdigit((unsigned char)*p); p++)
+                        ;
+                    if (*p == ')') {
+                        dst = stpcpy(dst, "(PID)");
+                        src = p + 1;
+                        continue;
+                    }
+                }
+                *dst++ = *src++;
+            }
+            if (*eol)
+                *dst++ = '\n';
+        }
+        src = *eol ? eol + 1 : eol;
+    }
+    *dst = '\0';
+    free(text);
+    return out;
+}
+
+/* expected - Return trace's section of the reference output, or NULL */
+static char *expected(const char *trace)
+{
+    char line[MAXLINE], key[MAXLINE];
+    const char *base = strrchr(trace, '/') ? strrchr(trace, '/') + 1 : trace;
+    char *text = NULL;
+    size_t len = 0;
+    FILE *in, *out = NULL;
+
+    if ((in = fopen(reference, "r")) == NULL)
+        return NULL;
+    snprintf(key, sizeof(key), "-t %s ", base);
+    while (fgets(line, MAXLINE, in) != NULL) {
+        if (!strncmp(line, "./sdriver.pl", 12)) {
+            if (out != NULL)
+                break;
+            if (strstr(line, key) != NULL && (out = open_memstream(&text, &len)) == NULL)
+                unix_error("open_memstream error");
+        }
+        else if (out != NULL && strncmp(line, "make", 4))
+            fputs(line, out);
+    }
+    fclose(in);
+    if (out != NULL)
+        fclose(out);
+    return text;
+}
+
+/* cmpdouble - qsort comparison for latencies */
+static int cmpdouble(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * runtrace - Replay a trace and write its report to fp. Return 0 if
+ * the output matched the reference.
+ */
+static int runtrace(const char *trace, FILE *fp)
+{
+    struct replay_t r;
+    double start = now(), lat[MAXCMDS + 1], cpu;
+    char *text, *want, *a, *b, *ea, *eb;
+    size_t len;
+    int i, n = 0, same, shown;
+
+    memset(&r, 0, sizeof(r));
+    replay(trace, &r, &text, &len);
+    text = normalize(text);
+    if ((want = expected(trace)) != NULL)
+        want = normalize(want);
+    same = (want != NULL && !strcmp(text, want));
+
+    for (i = 1; i <= r.sent && i + 1 <= r.ready; i++)
+        lat[n++] = (r.tready[i + 1] - (r.tsent[i] > r.tready[i] ? r.tsent[i] : r.tready[i])) * 1e3;
+    cpu = (r.ru.ru_utime.tv_sec + r.ru.ru_stime.tv_sec) * 1e3 +
+          (r.ru.ru_utime.tv_usec + r.ru.ru_stime.tv_usec) / 1e3;
+    fprintf(fp, "%s: %s  wall %.2fs  cpu %.1fms  cmds %d", trace,
+            want == NULL ? "NOREF" : same ? "PASS" : "FAIL", now() - start, cpu, r.sent);
+    if (verbose)
+        for (i = 0; i < n; i++)
+            fprintf(fp, "\n    %8.3fms  %.*s", lat[i], (int)strcspn(r.cmds[i+1], "\n"), r.cmds[i+1]);
+    if (n > 0) {
+        qsort(lat, n, sizeof(double), cmpdouble);
+        fprintf(fp, "%slatency median %.3fms max %.3fms", verbose ? "\n    " : "  ",
+                lat[n / 2], lat[n - 1]);
+    }
+    fprintf(fp, "\n");
+
+    if (want != NULL && !same) {
+        /* show the lines from the first difference on */
+        for (a = want, b = text; *a && *b; a = ea + 1, b = eb + 1) {
+            ea = strchrnul(a, '\n');
+            eb = strchrnul(b, '\n');
+            if (ea - a != eb - b || memcmp(a, b, ea - a) || !*ea || !*eb)
+                break;
+        }
+        for (shown = 0; *a && shown < 20; a = *ea ? ea + 1 : ea, shown++)
+            fprintf(fp, "  - %.*s\n", (int)((ea = strchrnul(a, '\n')) - a), a);
+        for (shown = 0; *b && shown < 20; b = *eb ? eb + 1 : eb, shown++)
+            fprintf(fp, "  + %.*s\n", (int)((eb = strchrnul(b, '\n')) - b), b);
+    }
+    free(text);
+    free(want);
+    return !same;
+}
+
+/* checkbuild - Refuse to test a shell that is missing or older than
+   tsh.c, which would be testing some other version of it */
+static void checkbuild(void)
+{
+    struct stat sh, src;
+
+    if (stat(shellprog, &sh) < 0) {
+        fprintf(stderr, "tshtrace: %s: %s (run make)\n", shellprog, strerror(errno));
+        exit(2);
+    }
+    if (!strcmp(shellprog, "./tsh") && stat("tsh.c", &src) == 0 &&
+        (src.st_mtim.tv_sec > sh.st_mtim.tv_sec ||
+         (src.st_mtim.tv_sec == sh.st_mtim.tv_sec && src.st_mtim.tv_nsec > sh.st_mtim.tv_nsec))) {
+        fprintf(stderr, "tshtrace: ./tsh is older than tsh.c (run make)\n");
+        exit(2);
+    }
+}
+
+/* usage - print a help message */
+static void usage(void)
+{
+    printf("Usage: tshtrace [-hv] [-s <shell>] [-a <args>] [-r <reference>] [trace ...]\n");
+    printf("   -h   print this message\n");
+    printf("   -v   list the latency of every command\n");
+    printf("   -s   shell to test (default ./tsh)\n");
+    printf("   -a   shell arguments (default -p)\n");
+    printf("   -r   reference output (default tshref.out)\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    FILE *reports[MAXCMDS];
+    pid_t pids[MAXCMDS];
+    char **traces, buf[4096], *arg;
+    glob_t g;
+    int c, i, n, ntraces, status, failed = 0;
+    size_t k;
+
+    while ((c = getopt(argc, argv, "hvs:a:r:")) != EOF) {
+        switch (c) {
+        case 'v':
+            verbose = 1;
+            break;
+        case 's':
+            shellprog = optarg;
+            break;
+        case 'a':
+            for (i = 1, arg = strtok(optarg, " "); arg && i < MAXARGS - 1; arg = strtok(NULL, " "))
+                shellargs[i++] = arg;
+            shellargs[i] = NULL;
+            break;
+        case 'r':
+            reference = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind < argc) {
+        traces = argv + optind;
+        ntraces = argc - optind;
+    }
+    else {
+        if (glob("trace[0-9][0-9].txt", 0, NULL, &g) != 0) {
+            fprintf(stderr, "tshtrace: no trace files\n");
+            exit(2);
+        }
+        traces = g.gl_pathv;
+        ntraces = g.gl_pathc;
+    }
+    if (ntraces > MAXCMDS)
+        ntraces = MAXCMDS;
+    checkbuild();
+
+    /* One replayer per trace, all at once; reports go to temp files */
+    fflush(stdout);
+    for (i = 0; i < ntraces; i++) {
+        if ((reports[i] = tmpfile()) == NULL)
+            unix_error("tmpfile error");
+        if ((pids[i] = fork()) < 0)
+            unix_error("fork error");
+        if (pids[i] == 0)
+            exit(runtrace(traces[i], reports[i]) || fclose(reports[i]) != 0);
+    }
+    for (i = 0; i < ntraces; i++) {
+        if (waitpid(pids[i], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status))
+            failed++;
+        rewind(reports[i]);
+        while ((k = fread(buf, 1, sizeof(buf), reports[i])) > 0)
+            fwrite(buf, 1, k, stdout);
+        fclose(reports[i]);
+    }
+    n = ntraces - failed;
+    printf("%d of %d traces match %s\n", n, ntraces, reference);
+    exit(failed != 0);
+}